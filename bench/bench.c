@@ -0,0 +1,522 @@
+//host benchmark harness for alloc.c, kbitmap.c and the string routines of common.c
+//every result is printed as one JSON object per line
+#define BENCH_HOST
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "kbitmap.h"
+#include "cpu.h"
+#include "checksum.h"
+#include "mutex.h"
+
+#define ARENA_SIZE     (1UL << 32)
+#define ALLOC_SLOTS    4096
+#define ALLOC_OPS      2000000
+#define POWER_LAW_MAX  (1 << 20)
+#define REALLOC_SLOTS  256
+#define REALLOC_MAX    (1 << 18)
+#define REALLOC_OPS    100000
+#define BITMAP_ITEMS   (1 << 20)
+#define BITMAP_OPS     2000000
+#define FLAT_OPS       20000
+#define BITMAP_BATCH   256
+#define VM_REGIONS_SLOTS 8192
+
+//alloc.o is built with pointer wide u32int, kernel names clashing with libc carry a kernel_ prefix
+void* kernel_malloc(unsigned long size);
+void* kernel_realloc(void *ptr, unsigned long size);
+void* kernel_memalign(unsigned long alignment, unsigned long size);
+void  kernel_free(void *ptr);
+void* kernel_memset(void *s, int c, size_t n);
+void* kernel_memcpy(void *dst, const void *src, size_t n);
+void* kernel_memmove(void *dst, const void *src, size_t n);
+void  init_string_ops();
+void  init_checksum();
+
+typedef enum workload_enum {
+        uniform,
+        power_law,
+        producer_consumer,
+        realloc_growth,
+        aligned
+} workload_t;
+
+static const char *workload_names[] = {"uniform", "power_law", "producer_consumer", "realloc_growth", "aligned"};
+
+//mock heap: sbrk moves a break inside one big reserved mapping
+static char  *arena, *arena_brk, *arena_high;
+//heap plus vmalloc bytes
+static size_t vm_bytes, footprint_high;
+
+static void update_footprint()
+{
+        size_t footprint = (arena_brk - arena) + vm_bytes;
+        if (footprint > footprint_high)
+                footprint_high = footprint;
+}
+
+void* sbrk(long increment)
+{
+        char *old = arena_brk;
+        if (arena_brk + increment < arena || arena_brk + increment > arena + ARENA_SIZE)
+                return NULL;
+        arena_brk += increment;
+        if (increment < 0)
+                madvise(arena_brk, -increment, MADV_DONTNEED);
+        if (arena_brk > arena_high)
+                arena_high = arena_brk;
+        update_footprint();
+
+        return old;
+}
+
+//like the kernel, released pages read back as zeroes
+void heap_release_pages(void *address, unsigned long pages_count)
+{
+        madvise(address, pages_count * PAGE_SIZE, MADV_DONTNEED);
+}
+
+bool heap_contains(void *address)
+{
+        return (char*)address >= arena && (char*)address < arena + ARENA_SIZE;
+}
+
+//mock vmalloc: every region is its own mapping, sizes are kept in a linear probing hash table
+static struct {
+        void          *address;
+        unsigned long  pages_count;
+} vm_regions[VM_REGIONS_SLOTS];
+
+static unsigned long vm_slot(void *address)
+{
+        unsigned long slot = ((unsigned long)address / PAGE_SIZE) % VM_REGIONS_SLOTS;
+        while (vm_regions[slot].address != address && vm_regions[slot].address != NULL)
+                slot = (slot + 1) % VM_REGIONS_SLOTS;
+
+        return slot;
+}
+
+void* vmalloc(unsigned long pages_count)
+{
+        void *address = mmap(NULL, pages_count * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED)
+                return NULL;
+        unsigned long slot = vm_slot(address);
+        vm_regions[slot].address     = address;
+        vm_regions[slot].pages_count = pages_count;
+        vm_bytes += pages_count * PAGE_SIZE;
+        update_footprint();
+
+        return address;
+}
+
+//removal by backward shift keeps the probe chains intact
+static void vm_forget(unsigned long slot)
+{
+        unsigned long next = (slot + 1) % VM_REGIONS_SLOTS;
+        vm_regions[slot].address = NULL;
+        while (vm_regions[next].address != NULL) {
+                void *address = vm_regions[next].address;
+                unsigned long pages_count = vm_regions[next].pages_count;
+                vm_regions[next].address = NULL;
+                slot = vm_slot(address);
+                vm_regions[slot].address     = address;
+                vm_regions[slot].pages_count = pages_count;
+                next = (next + 1) % VM_REGIONS_SLOTS;
+        }
+}
+
+void vfree(void *address)
+{
+        unsigned long slot = vm_slot(address);
+        munmap(address, vm_regions[slot].pages_count * PAGE_SIZE);
+        vm_bytes -= vm_regions[slot].pages_count * PAGE_SIZE;
+        vm_forget(slot);
+}
+
+unsigned long vmalloc_size(void *address)
+{
+        unsigned long slot = vm_slot(address);
+        return (vm_regions[slot].address == address) ? vm_regions[slot].pages_count : 0;
+}
+
+void* vrealloc(void *address, unsigned long pages_count)
+{
+        unsigned long slot = vm_slot(address);
+        void *moved = mremap(address, vm_regions[slot].pages_count * PAGE_SIZE, pages_count * PAGE_SIZE, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED)
+                return NULL;
+        vm_bytes += (pages_count - vm_regions[slot].pages_count) * PAGE_SIZE;
+        update_footprint();
+        vm_forget(slot);
+        slot = vm_slot(moved);
+        vm_regions[slot].address     = moved;
+        vm_regions[slot].pages_count = pages_count;
+
+        return moved;
+}
+
+void panic(const char *message, const char *file, unsigned long line)
+{
+        fprintf(stderr, "panic: %s at %s:%lu\n", message, file, line);
+        abort();
+}
+
+void panic_assert(const char *file, unsigned long line, const char *desc)
+{
+        fprintf(stderr, "assertion failed: %s at %s:%lu\n", desc, file, line);
+        abort();
+}
+
+void mutex_lock(mutex_t *m)
+{
+        if (m->locked)
+                panic("mutex is locked twice", __FILE__, __LINE__);
+        m->locked = LOCKED;
+}
+
+void mutex_unlock(mutex_t *m)
+{
+        m->locked = UNLOCKED;
+}
+
+bool mutex_trylock(mutex_t *m)
+{
+        if (m->locked)
+                return FALSE;
+        m->locked = LOCKED;
+        return TRUE;
+}
+
+bool in_irq()
+{
+        return FALSE;
+}
+
+unsigned long irq_save()
+{
+        return 0;
+}
+
+void irq_restore(unsigned long eflags)
+{
+}
+
+//common.c prints through the screen driver
+void move_next_cursor_postion() { }
+void move_back_cursor_postion() { }
+void new_line() { }
+void print_symbol(char c) { }
+
+static double now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static u32int next_random(u32int *seed)
+{
+        *seed = *seed * 1103515245 + 12345;
+        return *seed >> 1;
+}
+
+static size_t workload_size(workload_t workload, u32int *seed)
+{
+        switch (workload) {
+        case power_law: {
+                double u    = (next_random(seed) + 1.0) / 2147483649.0;
+                double size = 16.0 * pow(u, -1.0 / 1.1);
+                return (size > POWER_LAW_MAX) ? POWER_LAW_MAX : (size_t)size;
+        }
+        case realloc_growth:
+                return 512 + next_random(seed) % 512;
+        case producer_consumer:
+                return (next_random(seed) % 64 == 0) ? 8192 + next_random(seed) % 65536 : 16 + next_random(seed) % 1008;
+        default:
+                return 1 + next_random(seed) % 4096;
+        }
+}
+
+//the first and the last byte of every block carry its slot number
+static void fill_block(u8int *block, size_t size, u32int slot)
+{
+        block[0] = block[size - 1] = (u8int)slot;
+}
+
+static void check_block(u8int *block, size_t size, u32int slot)
+{
+        if (block[0] != (u8int)slot || block[size - 1] != (u8int)slot)
+                panic("allocation was overwritten", __FILE__, __LINE__);
+}
+
+static void run_alloc_workload(workload_t workload)
+{
+        static u8int  *blocks[ALLOC_SLOTS];
+        static size_t  sizes[ALLOC_SLOTS];
+        u32int seed = 1, op, slot, head = 0, failed = 0;
+        u32int ops  = (workload == realloc_growth) ? REALLOC_OPS : ALLOC_OPS;
+        size_t live = 0, peak_live = 0;
+
+        arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED)
+                panic("can not reserve the arena", __FILE__, __LINE__);
+        arena_brk = arena_high = arena;
+
+        double start = now_ns();
+        for (op = 0; op < ops; op++) {
+                //producer/consumer frees in allocation order, the others at random
+                slot = (workload == producer_consumer) ? head++ % ALLOC_SLOTS
+                     : (workload == realloc_growth)    ? next_random(&seed) % REALLOC_SLOTS
+                                                       : next_random(&seed) % ALLOC_SLOTS;
+                //growing buffers double until REALLOC_MAX, then they are freed
+                if (workload == realloc_growth && blocks[slot] != NULL && sizes[slot] < REALLOC_MAX) {
+                        check_block(blocks[slot], sizes[slot], slot);
+                        u8int *grown = kernel_realloc(blocks[slot], sizes[slot] * 2);
+                        if (grown == NULL) {
+                                failed++;
+                                continue;
+                        }
+                        if (grown[0] != (u8int)slot)
+                                panic("realloc lost the block contents", __FILE__, __LINE__);
+                        blocks[slot] = grown;
+                        live        += sizes[slot];
+                        sizes[slot] *= 2;
+                        fill_block(blocks[slot], sizes[slot], slot);
+                        if (live > peak_live)
+                                peak_live = live;
+                        continue;
+                }
+                if (blocks[slot] != NULL) {
+                        check_block(blocks[slot], sizes[slot], slot);
+                        kernel_free(blocks[slot]);
+                        blocks[slot] = NULL;
+                        live        -= sizes[slot];
+                        if (workload != producer_consumer)
+                                continue;
+                }
+                sizes[slot]  = workload_size(workload, &seed);
+                if (workload == aligned) {
+                        unsigned long alignment = 1UL << (next_random(&seed) % 13);
+                        blocks[slot] = kernel_memalign(alignment, sizes[slot]);
+                        if ((unsigned long)blocks[slot] % alignment != 0)
+                                panic("memalign returned a misaligned block", __FILE__, __LINE__);
+                } else
+                        blocks[slot] = kernel_malloc(sizes[slot]);
+                if (blocks[slot] == NULL) {
+                        failed++;
+                        continue;
+                }
+                fill_block(blocks[slot], sizes[slot], slot);
+                live += sizes[slot];
+                if (live > peak_live)
+                        peak_live = live;
+        }
+        double elapsed = now_ns() - start;
+
+        //fragmentation: heap plus vmalloc high water against the most bytes ever requested at once
+        printf("{\"bench\": \"alloc\", \"workload\": \"%s\", \"ops\": %u, \"ns_per_op\": %.1f, \"failed\": %u, "
+               "\"peak_live_bytes\": %zu, \"heap_high_water_bytes\": %zu, \"heap_final_bytes\": %zu, "
+               "\"footprint_high_water_bytes\": %zu, \"vmalloc_final_bytes\": %zu, \"fragmentation\": %.3f}\n",
+               workload_names[workload], ops, elapsed / ops, failed, peak_live,
+               (size_t)(arena_high - arena), (size_t)(arena_brk - arena), footprint_high, vm_bytes,
+               (double)footprint_high / peak_live);
+}
+
+//allocator state is global, every workload gets a fresh process
+static void run_isolated(void (*bench)(workload_t), workload_t workload)
+{
+        int status;
+        pid_t pid = fork();
+        if (pid == 0) {
+                bench(workload);
+                fflush(stdout);
+                _exit(0);
+        }
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("{\"bench\": \"alloc\", \"workload\": \"%s\", \"error\": \"crashed\"}\n", workload_names[workload]);
+                exit(1);
+        }
+}
+
+//allocation-like pattern: take the first clear item, give back a random used one
+//batches are allocated first fit and then freed again, so the occupancy stays put
+static void run_bitmap_occupancy(u32int occupancy, bool flat_scan)
+{
+        u32int op, i, seed = 7, found = 0;
+        u32int ops = flat_scan ? FLAT_OPS : BITMAP_OPS;
+        u32int batch[BITMAP_BATCH];
+        double alloc_ns = 0, free_ns = 0;
+        kbitmap_t bitmap;
+        void  *storage = malloc(kbitmap_storage_size(BITMAP_ITEMS));
+        u8int *flat    = malloc(bitmap_in_bytes(BITMAP_ITEMS));
+
+        kbitmap_init(&bitmap, storage, BITMAP_ITEMS, FALSE);
+        memset(flat, 0, bitmap_in_bytes(BITMAP_ITEMS));
+        for (i = 0; i < BITMAP_ITEMS; i++) {
+                if (next_random(&seed) % 100 < occupancy) {
+                        kbitmap_set(&bitmap, i);
+                        set_bit(flat, i);
+                }
+        }
+
+        for (op = 0; op < ops; op += BITMAP_BATCH) {
+                u32int count = 0;
+                double start = now_ns();
+                for (i = 0; i < BITMAP_BATCH; i++) {
+                        u32int item = flat_scan ? first_clear_bit(flat, BITMAP_ITEMS) : kbitmap_first_clear(&bitmap);
+                        if (item == (u32int)-1)
+                                break;
+                        if (flat_scan)
+                                set_bit(flat, item);
+                        else
+                                kbitmap_set(&bitmap, item);
+                        batch[count++] = item;
+                }
+                alloc_ns += now_ns() - start;
+                found += count;
+
+                start = now_ns();
+                for (i = 0; i < count; i++) {
+                        if (flat_scan)
+                                clear_bit(flat, batch[i]);
+                        else
+                                kbitmap_clear(&bitmap, batch[i]);
+                }
+                free_ns += now_ns() - start;
+        }
+        printf("{\"bench\": \"bitmap\", \"impl\": \"%s\", \"occupancy\": %u, \"items\": %u, \"ops\": %u, "
+               "\"alloc_ns_per_op\": %.1f, \"free_ns_per_op\": %.1f}\n",
+               flat_scan ? "flat" : "kbitmap", occupancy, BITMAP_ITEMS, found, alloc_ns / found, free_ns / found);
+
+        free(storage);
+        free(flat);
+}
+
+static void run_bitmap_bench()
+{
+        static const u32int occupancies[] = {10, 50, 99};
+        u32int i;
+
+        for (i = 0; i < sizeof(occupancies) / sizeof(occupancies[0]); i++) {
+                run_bitmap_occupancy(occupancies[i], FALSE);
+                run_bitmap_occupancy(occupancies[i], TRUE);
+        }
+}
+
+//odd lengths and offsets walk every head and tail path
+static void check_string_ops(u8int *buf, u8int *ref)
+{
+        static const size_t lengths[] = {0, 1, 3, 63, 64, 67, 4097, (2 << 20) + 5};
+        u32int i, offset;
+
+        for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+                for (offset = 0; offset < 4; offset++) {
+                        size_t n = lengths[i], total = n + 16;
+                        size_t j;
+                        for (j = 0; j < total; j++)
+                                ref[j] = buf[j] = (u8int)(j * 7 + offset);
+                        kernel_memmove(buf + offset + 3, buf + offset, n);
+                        memmove(ref + offset + 3, ref + offset, n);
+                        kernel_memmove(buf + 1, buf + offset + 2, n);
+                        memmove(ref + 1, ref + offset + 2, n);
+                        kernel_memcpy(buf + offset, buf + total, n);
+                        memcpy(ref + offset, ref + total, n);
+                        kernel_memset(buf + 3 - offset, 0xA0 + offset, n);
+                        memset(ref + 3 - offset, 0xA0 + offset, n);
+                        if (memcmp(buf, ref, total))
+                                panic("string routine result differs from libc", __FILE__, __LINE__);
+                }
+        }
+}
+
+static void run_string_bench()
+{
+        volatile u8int sink;
+        static const size_t sizes[] = {8, 64, 512, 4096, 32 << 10, 256 << 10, 1 << 20, 8 << 20};
+        const size_t total = 256 << 20;
+        u8int *src = malloc(16 << 20), *dst = malloc(16 << 20);
+        u32int i, impl;
+
+        memset(dst, 0x3C, 16 << 20);
+        memset(src, 0x3C, 16 << 20);
+        check_string_ops(dst, src);
+        memset(src, 0x5A, 16 << 20);
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                for (impl = 0; impl < 2; impl++) {
+                        size_t done;
+                        double start = now_ns();
+                        for (done = 0; done < total; done += sizes[i])
+                                impl ? memcpy(dst, src, sizes[i]) : kernel_memcpy(dst, src, sizes[i]);
+                        double copy = now_ns() - start;
+                        sink = dst[sizes[i] - 1];
+                        start = now_ns();
+                        for (done = 0; done < total; done += sizes[i])
+                                impl ? memset(dst, (u8int)done, sizes[i]) : kernel_memset(dst, (u8int)done, sizes[i]);
+                        double set = now_ns() - start;
+                        sink = dst[sizes[i] - 1];
+                        //overlapping by a word, dst above src takes the backward path
+                        start = now_ns();
+                        for (done = 0; done < total; done += sizes[i])
+                                impl ? memmove(src + 4, src, sizes[i]) : kernel_memmove(src + 4, src, sizes[i]);
+                        double move = now_ns() - start;
+                        sink = src[sizes[i] - 1];
+                        printf("{\"bench\": \"string\", \"impl\": \"%s\", \"size\": %zu, \"memcpy_mb_s\": %.1f, \"memset_mb_s\": %.1f, \"memmove_mb_s\": %.1f}\n",
+                               impl ? "libc" : "kernel", sizes[i], total / copy * 1e3, total / set * 1e3, total / move * 1e3);
+                }
+        }
+
+        free(src);
+        free(dst);
+}
+
+static void run_checksum_bench()
+{
+        static const size_t sizes[] = {64, 4096, 1 << 20};
+        const size_t total = 256 << 20;
+        u8int *buf = malloc(1 << 20);
+        u32int i, crc = 0;
+
+        if (crc32c(0, "123456789", 9) != 0xE3069283)
+                panic("crc32c check value mismatch", __FILE__, __LINE__);
+        memset(buf, 0xA5, 1 << 20);
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                size_t done;
+                double start = now_ns();
+                for (done = 0; done < total; done += sizes[i])
+                        crc = crc32c(crc, buf, sizes[i]);
+                double elapsed = now_ns() - start;
+                printf("{\"bench\": \"crc32c\", \"impl\": \"%s\", \"size\": %zu, \"mb_s\": %.1f, \"crc\": %u}\n",
+                       cpu_has(CPU_FEATURE_SSE4_2) ? "sse4.2" : "table", sizes[i], total / elapsed * 1e3, crc);
+        }
+
+        free(buf);
+}
+
+int main()
+{
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        init_cpu();
+        init_string_ops();
+        init_checksum();
+        printf("{\"bench\": \"cpu\", \"vendor\": \"%s\", \"cache_line\": %u, \"sse2\": %d, \"sse4_2\": %d, \"erms\": %d, \"tsc\": %d}\n",
+               cpu_info.vendor, cpu_info.cache_line, cpu_has(CPU_FEATURE_SSE2), cpu_has(CPU_FEATURE_SSE4_2),
+               cpu_has(CPU_FEATURE_ERMS), cpu_has(CPU_FEATURE_TSC));
+        run_isolated(run_alloc_workload, uniform);
+        run_isolated(run_alloc_workload, power_law);
+        run_isolated(run_alloc_workload, producer_consumer);
+        run_isolated(run_alloc_workload, realloc_growth);
+        run_isolated(run_alloc_workload, aligned);
+        run_bitmap_bench();
+        run_string_bench();
+        run_checksum_bench();
+
+        return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+//host stand-in for src/common.h, used by the benchmark harness only
+
+#define PAGE_SIZE 0x1000
+#ifndef NULL
+#define NULL      0x0
+#endif
+#define TRUE      0x1
+#define FALSE     0x0
+
+#define IRQ_OFF        { }
+#define IRQ_RES        { }
+#define HLT_CPU        { }
+#define STOP_KERNEL    { while (1) { } }
+
+//alloc.c keeps pointers in u32int, on a 64-bit host it needs pointer wide words
+#ifdef BENCH_WIDE_WORDS
+typedef unsigned long  u32int;
+typedef          long  s32int;
+#else
+typedef unsigned int   u32int;
+typedef          int   s32int;
+#endif
+typedef unsigned short u16int;
+typedef          short s16int;
+typedef unsigned char  u8int;
+typedef          char  s8int;
+typedef unsigned char  bool;
+typedef unsigned long  size_t;
+
+void   outb(u16int port, u8int value);
+u8int  inb(u16int port);
+u16int inw(u16int port);
+
+//kernel string routines and printf are renamed with -D so they do not clash with libc,
+//the harness itself uses libc and skips these
+#ifndef BENCH_HOST
+void   init_string_ops();
+void  *memset(void *s, int c, size_t n);
+void  *memcpy(void *dst, const void *src, size_t n);
+void  *memset_rep(void *s, int c, size_t n);
+void  *memcpy_rep(void *dst, const void *src, size_t n);
+void  *memmove(void *dst, const void *src, size_t n);
+void  *memchr(const void *buf, int c, size_t n);
+int    memcmp(const void *s1, const void *s2, size_t n);
+size_t strlen(const char *str);
+char  *strcpy(char *dst, const char *src);
+char  *strncpy(char *dst, const char *src, size_t n);
+int    strcmp(const char *s1, const char *s2);
+void   itoa(char *buf, int base, int d);
+void   putchar(int c);
+void   printf(const char *format, ...);
+#endif
+
+#endif //COMMON_H
@@ -97,17 +97,26 @@
  *
  * TODO: Try to be more consistent on comment widths...
  * FIXME: Make thread safe! Not necessary for competition, but would be nice.
- * FIXME: Splitting/coalescing is broken. Fix this ASAP!
  *
 **/
 
 #include "common.h"
 #include "panic.h"
 #include "mutex.h"
+#include "kheap.h"
+#include "isr.h"
+#include "alloc.h"
+#include "vmalloc.h"
+#include "cpu.h"
 
 #define CHAR_BIT 8
+#if __SIZEOF_POINTER__ == 8
+#define NUM_BINS 10U								/* Number of bins, total, under 64-bit (host builds). */
+#define SMALLEST_BIN_LOG 3U							/* Logarithm base two of the smallest bin: log_2(sizeof(int64)). */
+#else
 #define NUM_BINS 11U								/* Number of bins, total, under 32-bit. */
 #define SMALLEST_BIN_LOG 2U							/* Logarithm base two of the smallest bin: log_2(sizeof(int32)). */
+#endif
 #define BIG_BIN (NUM_BINS - 1)						/* Index for the big bin, (NUM_BINS - 1) */
 #define SMALLEST_BIN (1UL << SMALLEST_BIN_LOG)		/* Size of the smallest bin. */
 
@@ -117,6 +126,13 @@
 #define SKIP_MAX_LEVEL 6							/* We have a maximum of 6 levels in our skip lists. */
 
 #define BIN_MAGIC 0xDEFAD00D
+#define RELEASE_PAGES 4								/* Free big bins with this many pages past the header give their frames back. */
+#define MAGAZINE_SIZE 16							/* Objects held per size class and context. */
+#define MAGAZINE_NORMAL 0
+#define MAGAZINE_IRQ 1
+#define LARGE_ALLOC_SIZE 0x10000					/* Requests this big get their own vmalloc region. */
+#define STATS_HISTOGRAM 16							/* Latency buckets, powers of two of cycles. */
+#define STATS_HISTOGRAM_SHIFT 4						/* The first bucket holds everything below 2^(shift+1) cycles. */
 
 /*
  * Internal functions.
@@ -127,40 +143,163 @@ static void* klcalloc(u32int nmemb, u32int size);
 static void* klvalloc(u32int size);
 static void  klfree(void * ptr);
 
+static void* klmalloc_irq(u32int size);
+static void  klfree_irq(void * ptr);
+static void* klmalloc_magazine_alloc(u32int size);
+static int   klmalloc_magazine_free(void * ptr);
+static u32int klmalloc_rdtsc(void);
+static void  klmalloc_account_alloc(void * ptr, u32int size, u32int cycles);
+static void  klmalloc_account_free(void * ptr);
+static void  klmalloc_account_cycles(u32int * histogram, u32int cycles);
+static void  klmalloc_account_realloc(u32int old_usable, void * ptr, u32int size);
+static u32int klmalloc_usable_size(void * ptr, u32int * bin);
+static int   klmalloc_is_large(void * ptr);
+static void* klmalloc_large(u32int size);
+static void* klrealloc_large(void * ptr, u32int size);
+
+/*
+ * Always-on allocator counters, see the Statistics section.
+ */
+static struct _klmalloc_stats {
+	u32int allocs[NUM_BINS];				/* Per bin, BIG_BIN for big allocations. */
+	u32int frees[NUM_BINS];
+	u32int failed;							/* Allocations that returned NULL. */
+	u32int reallocs;
+	u32int live_bytes;						/* Usable bytes handed out and not freed. */
+	u32int peak_bytes;
+	u32int requested_bytes;					/* Running totals, their difference is rounding waste. */
+	u32int granted_bytes;
+	u32int sbrk_calls;
+	u32int sbrk_pages;						/* Pages the heap grew by. */
+	u32int shrunk_pages;					/* Pages given back with a negative sbrk. */
+	u32int released_pages;					/* Pages handed to heap_release_pages(). */
+	u32int malloc_cycles[STATS_HISTOGRAM];
+	u32int free_cycles[STATS_HISTOGRAM];
+} klmalloc_stats;
+
 DEFINE_MUTEX(mem_lock);
 
+/*
+ * Only malloc, calloc and free may be called from an interrupt handler;
+ * realloc and valloc return NULL there, and so do requests bigger than
+ * the biggest small bin.
+ */
 void * malloc(u32int size) {
-	mutex_lock(&mem_lock);
-	void * ret = klmalloc(size);
-	mutex_unlock(&mem_lock);
+	u32int start = klmalloc_rdtsc();
+	void * ret;
+	if (in_irq()) {
+		ret = klmalloc_irq(size);
+	} else if (size >= LARGE_ALLOC_SIZE) {
+		ret = klmalloc_large(size);
+	} else {
+		ret = klmalloc_magazine_alloc(size);
+		if (!ret) {
+			mutex_lock(&mem_lock);
+			ret = klmalloc(size);
+			mutex_unlock(&mem_lock);
+		}
+	}
+	klmalloc_account_alloc(ret, size, klmalloc_rdtsc() - start);
 	return ret;
 }
 
 void * realloc(void * ptr, u32int size) {
-	mutex_lock(&mem_lock);
-	void * ret = klrealloc(ptr, size);
-	mutex_unlock(&mem_lock);
+	if (in_irq())
+		return NULL;
+	void * ret;
+	u32int old_usable = klmalloc_usable_size(ptr, NULL);
+	if (klmalloc_is_large(ptr)) {
+		ret = klrealloc_large(ptr, size);
+	} else if (size >= LARGE_ALLOC_SIZE) {
+		/*
+		 * Moving out of the heap costs one copy.
+		 */
+		ret = klmalloc_large(size);
+		if (ret && ptr) {
+			memcpy(ret, ptr, old_usable < size ? old_usable : size);
+			mutex_lock(&mem_lock);
+			klfree(ptr);
+			mutex_unlock(&mem_lock);
+		}
+	} else {
+		mutex_lock(&mem_lock);
+		ret = klrealloc(ptr, size);
+		mutex_unlock(&mem_lock);
+	}
+	if (ret || size == 0)
+		klmalloc_account_realloc(old_usable, ret, size);
 	return ret;
 }
 
 void * calloc(u32int nmemb, u32int size) {
-	mutex_lock(&mem_lock);
-	void * ret = klcalloc(nmemb, size);
-	mutex_unlock(&mem_lock);
+	void * ret;
+	if (in_irq()) {
+		ret = klmalloc_irq(nmemb * size);
+		if (ret)
+			memset(ret, 0x0, nmemb * size);
+	} else if (nmemb * size >= LARGE_ALLOC_SIZE) {
+		/*
+		 * Fresh vmalloc pages already read as zeroes.
+		 */
+		ret = klmalloc_large(nmemb * size);
+	} else {
+		mutex_lock(&mem_lock);
+		ret = klcalloc(nmemb, size);
+		mutex_unlock(&mem_lock);
+	}
+	klmalloc_account_alloc(ret, nmemb * size, 0);
 	return ret;
 }
 
 void * valloc(u32int size) {
-	mutex_lock(&mem_lock);
-	void * ret = klvalloc(size);
-	mutex_unlock(&mem_lock);
+	if (in_irq())
+		return NULL;
+	void * ret;
+	if (size >= LARGE_ALLOC_SIZE) {
+		ret = klmalloc_large(size);
+	} else {
+		mutex_lock(&mem_lock);
+		ret = klvalloc(size);
+		mutex_unlock(&mem_lock);
+	}
+	klmalloc_account_alloc(ret, size, 0);
 	return ret;
 }
 
+/*
+ * Small bin cells are aligned to their size, so an alignment up to the
+ * biggest small bin only rounds the request up to it. Up to a page the
+ * block comes from valloc(); bigger alignments are not supported.
+ */
+void * memalign(u32int alignment, u32int size) {
+	if (alignment == 0 || (alignment & (alignment - 1)) || alignment > PAGE_SIZE)
+		return NULL;
+	if (alignment <= SMALLEST_BIN)
+		return malloc(size);
+	if (alignment <= (SMALLEST_BIN << (BIG_BIN - 1)) && size <= (SMALLEST_BIN << (BIG_BIN - 1)))
+		return malloc(size > alignment ? size : alignment);
+	return valloc(size);
+}
+
+void * aligned_alloc(u32int alignment, u32int size) {
+	return memalign(alignment, size);
+}
+
 void free(void * ptr) {
-	mutex_lock(&mem_lock);
-    klfree(ptr);
-	mutex_unlock(&mem_lock);
+	u32int start = klmalloc_rdtsc();
+	if (in_irq()) {
+		klfree_irq(ptr);
+	} else {
+		klmalloc_account_free(ptr);
+		if (klmalloc_is_large(ptr)) {
+			vfree(ptr);
+		} else if (!klmalloc_magazine_free(ptr)) {
+			mutex_lock(&mem_lock);
+			klfree(ptr);
+			mutex_unlock(&mem_lock);
+		}
+	}
+	klmalloc_account_cycles(klmalloc_stats.free_cycles, klmalloc_rdtsc() - start);
 }
 
 
@@ -206,6 +345,14 @@ typedef struct _klmalloc_bin_header {
 	u32int bin_magic;
 } klmalloc_bin_header;
 
+/*
+ * Offset of the first cell in a small bin page.
+ */
+static u32int klmalloc_bin_offset(u32int bin) {
+	u32int cell = SMALLEST_BIN << bin;
+	return (sizeof(klmalloc_bin_header) + cell - 1) & ~(cell - 1);
+}
+
 /*
  * A big bin header is basically the same as a regular bin header
  * only with a pointer to the previous (physically) instead of
@@ -239,6 +386,147 @@ static struct _klmalloc_big_bins {
 klmalloc_big_bin_header * klmalloc_newest_big = NULL;		/* Newest big bin */
 
 /* }}} Bin management */
+/* Statistics {{{ */
+
+/*
+ * Always-on counters. Allocation counters are kept at the public entry
+ * points, so objects parked in magazines count as allocated here.
+ * Latencies are read_cycles() deltas of malloc() and free() (always 0
+ * without a tsc), calloc and valloc are counted without one. Updates run
+ * with interrupts off because handlers allocate too.
+ */
+static u32int klmalloc_rdtsc(void) {
+	return read_cycles();
+}
+
+/*
+ * Usable size of an allocated block and its bin, 0 for foreign pointers.
+ */
+static u32int klmalloc_usable_size(void * ptr, u32int * bin) {
+	if (ptr == NULL)
+		return 0;
+	if (klmalloc_is_large(ptr)) {
+		if (bin)
+			*bin = BIG_BIN;
+		return vmalloc_size(ptr) * PAGE_SIZE;
+	}
+	if ((u32int)ptr % PAGE_SIZE == 0)
+		ptr = (void *)((u32int)ptr - 1);
+	klmalloc_bin_header * header = (klmalloc_bin_header *)((u32int)ptr & (u32int)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC)
+		return 0;
+	if (header->size < BIG_BIN) {
+		if (bin)
+			*bin = header->size;
+		return SMALLEST_BIN << header->size;
+	}
+	if (bin)
+		*bin = BIG_BIN;
+	return header->size;
+}
+
+static void klmalloc_account_cycles(u32int * histogram, u32int cycles) {
+	u32int bucket = cycles ? sizeof(cycles) * CHAR_BIT - 1 - __builtin_clzl(cycles) : 0;
+	bucket = bucket > STATS_HISTOGRAM_SHIFT ? bucket - STATS_HISTOGRAM_SHIFT : 0;
+	if (bucket >= STATS_HISTOGRAM)
+		bucket = STATS_HISTOGRAM - 1;
+	u32int eflags = irq_save();
+	histogram[bucket]++;
+	irq_restore(eflags);
+}
+
+static void klmalloc_account_alloc(void * ptr, u32int size, u32int cycles) {
+	u32int bin = BIG_BIN;
+	u32int usable = klmalloc_usable_size(ptr, &bin);
+	u32int eflags = irq_save();
+	if (ptr) {
+		klmalloc_stats.allocs[bin]++;
+		klmalloc_stats.live_bytes += usable;
+		if (klmalloc_stats.live_bytes > klmalloc_stats.peak_bytes)
+			klmalloc_stats.peak_bytes = klmalloc_stats.live_bytes;
+		klmalloc_stats.requested_bytes += size;
+		klmalloc_stats.granted_bytes += usable;
+	} else if (size) {
+		klmalloc_stats.failed++;
+	}
+	irq_restore(eflags);
+	if (cycles)
+		klmalloc_account_cycles(klmalloc_stats.malloc_cycles, cycles);
+}
+
+static void klmalloc_account_free(void * ptr) {
+	u32int bin = BIG_BIN;
+	u32int usable = klmalloc_usable_size(ptr, &bin);
+	if (!usable)
+		return;
+	u32int eflags = irq_save();
+	klmalloc_stats.frees[bin]++;
+	klmalloc_stats.live_bytes -= usable;
+	irq_restore(eflags);
+}
+
+static void klmalloc_account_realloc(u32int old_usable, void * ptr, u32int size) {
+	u32int usable = klmalloc_usable_size(ptr, NULL);
+	u32int eflags = irq_save();
+	klmalloc_stats.reallocs++;
+	klmalloc_stats.live_bytes += usable - old_usable;
+	if (klmalloc_stats.live_bytes > klmalloc_stats.peak_bytes)
+		klmalloc_stats.peak_bytes = klmalloc_stats.live_bytes;
+	if (usable > old_usable) {
+		klmalloc_stats.requested_bytes += size;
+		klmalloc_stats.granted_bytes += usable;
+	}
+	irq_restore(eflags);
+}
+
+/*
+ * sbrk() with accounting. Needs mem_lock.
+ */
+static void * klmalloc_sbrk(s32int increment) {
+	klmalloc_stats.sbrk_calls++;
+	if (increment > 0)
+		klmalloc_stats.sbrk_pages += increment / PAGE_SIZE;
+	else
+		klmalloc_stats.shrunk_pages += -increment / PAGE_SIZE;
+	return sbrk(increment);
+}
+
+static void klmalloc_print_histogram(const char * name, u32int * histogram) {
+	u32int i;
+	printf("\n%s cycles:", name);
+	for (i = 0; i < STATS_HISTOGRAM; ++i) {
+		if (histogram[i])
+			printf(" %s2^%u:%u", i ? "" : "<", i + STATS_HISTOGRAM_SHIFT + 1, histogram[i]);
+	}
+}
+
+void print_alloc_info(void) {
+	u32int i, free_big = 0;
+	mutex_lock(&mem_lock);
+	klmalloc_big_bin_header * node = klmalloc_big_bins.head.forward[0];
+	for (; node; node = node->forward[0])
+		free_big++;
+	printf("heap: live %u bytes, peak %u bytes, requested %u of %u granted bytes",
+	       klmalloc_stats.live_bytes, klmalloc_stats.peak_bytes,
+	       klmalloc_stats.requested_bytes, klmalloc_stats.granted_bytes);
+	printf("\nsbrk: %u calls, +%u/-%u pages, %u pages released",
+	       klmalloc_stats.sbrk_calls, klmalloc_stats.sbrk_pages,
+	       klmalloc_stats.shrunk_pages, klmalloc_stats.released_pages);
+	printf("\nbins (allocs/frees):");
+	for (i = 0; i < BIG_BIN; ++i) {
+		if (i % 5 == 0)
+			printf("\n ");
+		printf(" %u:%u/%u", SMALLEST_BIN << i, klmalloc_stats.allocs[i], klmalloc_stats.frees[i]);
+	}
+	printf("\n  big:%u/%u, %u free big bins, skip list level %u, %u reallocs, %u failed",
+	       klmalloc_stats.allocs[BIG_BIN], klmalloc_stats.frees[BIG_BIN], free_big,
+	       klmalloc_big_bins.level, klmalloc_stats.reallocs, klmalloc_stats.failed);
+	klmalloc_print_histogram("malloc", klmalloc_stats.malloc_cycles);
+	klmalloc_print_histogram("free", klmalloc_stats.free_cycles);
+	mutex_unlock(&mem_lock);
+}
+
+/* }}} Statistics */
 /* Doubly-Linked List {{{ */
 
 /*
@@ -291,7 +579,7 @@ static klmalloc_bin_header * __attribute__ ((always_inline)) klmalloc_list_head(
  * Generate a random value in an appropriate range.
  * This is a xor-shift RNG.
  */
-static u32int __attribute__ ((pure)) klmalloc_skip_rand(void) {
+static u32int klmalloc_skip_rand(void) {
 	static u32int x = 123456789;
 	static u32int y = 362436069;
 	static u32int z = 521288629;
@@ -299,7 +587,7 @@ static u32int __attribute__ ((pure)) klmalloc_skip_rand(void) {
 
 	u32int t;
 
-	t = x ^ (x << 11);
+	t = (x ^ (x << 11)) & 0xFFFFFFFF;
 	x = y; y = z; z = w;
 	return w = w ^ (w >> 19) ^ t ^ (t >> 8);
 }
@@ -307,7 +595,7 @@ static u32int __attribute__ ((pure)) klmalloc_skip_rand(void) {
 /*
  * Generate a random level for a skip node
  */
-static int __attribute__ ((pure, always_inline)) klmalloc_random_level(void) {
+static int __attribute__ ((always_inline)) klmalloc_random_level(void) {
 	int level = 0;
 	/*
 	 * Keep trying to check rand() against 50% of its maximum.
@@ -457,18 +745,20 @@ static void klmalloc_skip_list_delete(klmalloc_big_bin_header * value) {
 		}
 		update[i] = node;
 	}
-	node = node->forward[0];
-	while (node != value) {
-		node = node->forward[0];
-	}
-
-	if (node != value) {
-		node = klmalloc_big_bins.head.forward[0];
-		while (node->forward[0] && node->forward[0] != value) {
-			node = node->forward[0];
+	/*
+	 * Bins of equal size sit in front of the first bigger one,
+	 * walk past them on every level until we meet the node.
+	 */
+	for (i = klmalloc_big_bins.level; i >= 0; --i) {
+		node = update[i];
+		while (node->forward[i] && node->forward[i] != value && node->forward[i]->size == value->size) {
+			node = node->forward[i];
+		}
+		if (node->forward[i] == value) {
+			update[i] = node;
 		}
-		node = node->forward[0];
 	}
+	node = update[0]->forward[0];
 	/*
 	 * If we found the node, delete it;
 	 * otherwise, we do nothing.
@@ -554,6 +844,104 @@ static int __attribute__ ((always_inline)) klmalloc_stack_empty(klmalloc_bin_hea
 }
 
 /* }}} Stack */
+/* Trimming {{{ */
+
+/*
+ * Give memory of a free big bin back to the kernel.
+ * Free big bins at the top of the heap are cut off with
+ * a negative sbrk; any other free big bin keeps its header
+ * page and the pages behind it are returned page by page.
+ */
+static void klmalloc_trim(klmalloc_big_bin_header * bheader) {
+	while (klmalloc_newest_big && klmalloc_newest_big->head != NULL &&
+	       (u32int)klmalloc_newest_big + klmalloc_newest_big->size + sizeof(klmalloc_big_bin_header) == (u32int)sbrk(0)) {
+		klmalloc_big_bin_header * top = klmalloc_newest_big;
+		klmalloc_skip_list_delete(top);
+		klmalloc_newest_big = top->prev;
+		if (klmalloc_newest_big) {
+			klmalloc_newest_big->next = NULL;
+		}
+		if (top == bheader) {
+			bheader = NULL;
+		}
+		klmalloc_sbrk(-(s32int)(top->size + sizeof(klmalloc_big_bin_header)));
+	}
+	if (bheader) {
+		u32int pages = (bheader->size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE - 1;
+		if (pages >= RELEASE_PAGES) {
+			heap_release_pages((void *)((u32int)bheader + PAGE_SIZE), pages);
+			klmalloc_stats.released_pages += pages;
+		}
+	}
+}
+
+/* }}} Trimming */
+/* Coalescing {{{ */
+
+/*
+ * Is the next physical big bin right behind us,
+ * with no small bins between?
+ */
+static int klmalloc_big_adjacent(klmalloc_big_bin_header * first, klmalloc_big_bin_header * second) {
+	return second && (u32int)first + first->size + sizeof(klmalloc_big_bin_header) == (u32int)second;
+}
+
+/*
+ * Free a big bin: merge it with free physical neighbours,
+ * put the result into the skip list and trim it.
+ * Free big bins are the ones with a non-empty stack.
+ */
+static void klmalloc_big_release(klmalloc_big_bin_header * bheader) {
+	ASSERT(bheader->head == NULL);
+	/*
+	 * Coalesce the forward block into us.
+	 */
+	klmalloc_big_bin_header * next = bheader->next;
+	if (klmalloc_big_adjacent(bheader, next) && next->head != NULL) {
+		klmalloc_skip_list_delete(next);
+		bheader->size += sizeof(klmalloc_big_bin_header) + next->size;
+		bheader->next = next->next;
+		if (next->next) {
+			next->next->prev = bheader;
+		}
+		if (klmalloc_newest_big == next) {
+			klmalloc_newest_big = bheader;
+		}
+	}
+	/*
+	 * Coalesce us into the backward block, it is already free.
+	 */
+	klmalloc_big_bin_header * prev = bheader->prev;
+	if (prev && klmalloc_big_adjacent(prev, bheader) && prev->head != NULL) {
+		klmalloc_skip_list_delete(prev);
+		prev->size += sizeof(klmalloc_big_bin_header) + bheader->size;
+		prev->next = bheader->next;
+		if (bheader->next) {
+			bheader->next->prev = prev;
+		}
+		if (klmalloc_newest_big == bheader) {
+			klmalloc_newest_big = prev;
+		}
+		bheader = prev;
+	} else {
+		/*
+		 * Push new space back into the stack.
+		 */
+		klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((u32int)bheader + sizeof(klmalloc_big_bin_header)));
+	}
+	ASSERT(bheader->head != NULL);
+	ASSERT((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+	/*
+	 * Insert the block into list of available slabs.
+	 */
+	klmalloc_skip_list_insert(bheader);
+	/*
+	 * And hand its memory back.
+	 */
+	klmalloc_trim(bheader);
+}
+
+/* }}} Coalescing */
 
 /* malloc() {{{ */
 static void * klmalloc(u32int size) {
@@ -580,14 +968,17 @@ static void * klmalloc(u32int size) {
 			/*
 			 * Grow the heap for the new bin.
 			 */
-			bin_header = (klmalloc_bin_header*)sbrk(PAGE_SIZE);
+			bin_header = (klmalloc_bin_header*)klmalloc_sbrk(PAGE_SIZE);
 			bin_header->bin_magic = BIN_MAGIC;
 			ASSERT((u32int)bin_header % PAGE_SIZE == 0);
 
 			/*
-			 * Set the head of the stack.
+			 * Set the head of the stack. Cells start at a multiple
+			 * of their own size, so every cell is naturally aligned;
+			 * the header costs one cell either way.
 			 */
-			bin_header->head = (void*)((u32int)bin_header + sizeof(klmalloc_bin_header));
+			u32int offset = klmalloc_bin_offset(bucket_id);
+			bin_header->head = (void*)((u32int)bin_header + offset);
 			/*
 			 * Insert the new bin at the front of
 			 * the list of bins for this size.
@@ -600,7 +991,7 @@ static void * klmalloc(u32int size) {
 			 * which points to NULL.
 			 */
 			u32int adj = SMALLEST_BIN_LOG + bucket_id;
-			u32int i, available = ((PAGE_SIZE - sizeof(klmalloc_bin_header)) >> adj) - 1;
+			u32int i, available = ((PAGE_SIZE - offset) >> adj) - 1;
 
 			u32int **base = bin_header->head;
 			for (i = 0; i < available; ++i) {
@@ -636,56 +1027,45 @@ static void * klmalloc(u32int size) {
 			 * Retreive the head of the block.
 			 */
 			u32int ** item = klmalloc_stack_pop((klmalloc_bin_header *)bin_header);
-#if 0
-			/*
-			 * Resize block, if necessary
-			 */
 			ASSERT(bin_header->head == NULL);
-			u32int old_size = bin_header->size;
-			//uintptr_t rsize = size;
 			/*
-			 * Round the requeste size to our full required size.
+			 * Split off whole pages we do not need.
 			 */
-			size = ((size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1) * PAGE_SIZE - sizeof(klmalloc_big_bin_header);
-			ASSERT((size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			if (bin_header->size > size * 2) {
-				ASSERT(old_size != size);
-				/*
-				 * If we have extra space, start splitting.
-				 */
-				bin_header->size = size;
-				ASSERT(sbrk(0) >= bin_header->size + (u32int)bin_header);
+			u32int total = ((size + sizeof(klmalloc_big_bin_header) + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+			if (bin_header->size + sizeof(klmalloc_big_bin_header) >= total + PAGE_SIZE) {
 				/*
-				 * Make a new block at the end of the needed space.
+				 * Make a new block at the end of the needed space
+				 * and link it in physical order right behind us.
 				 */
-				klmalloc_big_bin_header * header_new = (klmalloc_big_bin_header *)((u32int)bin_header + sizeof(klmalloc_big_bin_header) + size);
+				klmalloc_big_bin_header * header_new = (klmalloc_big_bin_header *)((u32int)bin_header + total);
 				ASSERT((u32int)header_new % PAGE_SIZE == 0);
-				memset(header_new, 0, sizeof(klmalloc_big_bin_header) + sizeof(void *));
+				header_new->bin_magic = BIN_MAGIC;
+				header_new->head = NULL;
+				header_new->size = bin_header->size + sizeof(klmalloc_big_bin_header) - total - sizeof(klmalloc_big_bin_header);
 				header_new->prev = bin_header;
+				header_new->next = bin_header->next;
 				if (bin_header->next) {
 					bin_header->next->prev = header_new;
 				}
-				header_new->next = bin_header->next;
 				bin_header->next = header_new;
 				if (klmalloc_newest_big == bin_header) {
 					klmalloc_newest_big = header_new;
 				}
-				header_new->size = old_size - (size + sizeof(klmalloc_big_bin_header));
-				ASSERT(((u32int)header_new->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-				fprintf(stderr, "Splitting %p [now %zx] at %p [%zx] from [%zx,%zx].\n", (void*)bin_header, bin_header->size, (void*)header_new, header_new->size, old_size, size);
+				bin_header->size = total - sizeof(klmalloc_big_bin_header);
+				ASSERT((bin_header->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
+				ASSERT((header_new->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
 				/*
 				 * Free the new block.
 				 */
-				klfree((void *)((u32int)header_new + sizeof(klmalloc_big_bin_header)));
+				klmalloc_big_release(header_new);
 			}
-#endif
 			return item;
 		} else {
 			/*
 			 * Round requested size to a set of pages, plus the header size.
 			 */
-			u32int pages = (size + sizeof(klmalloc_big_bin_header)) / PAGE_SIZE + 1;
-			bin_header = (klmalloc_big_bin_header*)sbrk(PAGE_SIZE * pages);
+			u32int pages = (size + sizeof(klmalloc_big_bin_header) + PAGE_MASK) / PAGE_SIZE;
+			bin_header = (klmalloc_big_bin_header*)klmalloc_sbrk(PAGE_SIZE * pages);
 			bin_header->bin_magic = BIN_MAGIC;
 			ASSERT((u32int)bin_header % PAGE_SIZE == 0);
 			/*
@@ -754,86 +1134,7 @@ static void klfree(void *ptr) {
 		ASSERT(bheader);
 		ASSERT(bheader->head == NULL);
 		ASSERT((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-		/*
-		 * Coalesce forward blocks into us.
-		 */
-#if 0
-		if (bheader != klmalloc_newest_big) {
-			/*
-			 * If we are not the newest big bin, there is most definitely
-			 * something in front of us that we can read.
-			 */
-			ASSERT((bheader->size + sizeof(klmalloc_big_bin_header)) % PAGE_SIZE == 0);
-			klmalloc_big_bin_header * next = (void *)((u32int)bheader + sizeof(klmalloc_big_bin_header) + bheader->size);
-			ASSERT((u32int)next % PAGE_SIZE == 0);
-			if (next == bheader->next && next->head) { //next->size > NUM_BINS && next->head) {
-				/*
-				 * If that something is an available big bin, we can
-				 * coalesce it into us to form one larger bin.
-				 */
-
-				u32int old_size = bheader->size;
-
-				klmalloc_skip_list_delete(next);
-				bheader->size = (u32int)bheader->size + (u32int)sizeof(klmalloc_big_bin_header) + next->size;
-				ASSERT((bheader->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-
-				if (next == klmalloc_newest_big) {
-					/*
-					 * If the guy in front of us was the newest,
-					 * we are now the newest (as we are him).
-					 */
-					klmalloc_newest_big = bheader;
-				} else {
-					if (next->next) {
-						next->next->prev = bheader;
-					}
-				}
-				fprintf(stderr,"Coelesced (forwards)  %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader, old_size, (void*)next, next->size, bheader->size);
-			}
-		}
-#endif
-		/*
-		 * Coalesce backwards
-		 */
-#if 0
-		if (bheader->prev && bheader->prev->head) {
-			/*
-			 * If there is something behind us, it is available, and there is nothing between
-			 * it and us, we can coalesce ourselves into it to form a big block.
-			 */
-			if ((u32int)bheader->prev + (bheader->prev->size + sizeof(klmalloc_big_bin_header)) == (u32int)bheader) {
-
-				u32int old_size = bheader->prev->size;
-
-				klmalloc_skip_list_delete(bheader->prev);
-				bheader->prev->size = (u32int)bheader->prev->size + (u32int)bheader->size + sizeof(klmalloc_big_bin_header);
-				ASSERT((bheader->prev->size + sizeof(klmalloc_big_bin_header))  % PAGE_SIZE == 0);
-				klmalloc_skip_list_insert(bheader->prev);
-				if (klmalloc_newest_big == bheader) {
-					klmalloc_newest_big = bheader->prev;
-				} else {
-					if (bheader->next) {
-						bheader->next->prev = bheader->prev;
-					}
-				}
-				fprintf(stderr,"Coelesced (backwards) %p [%zx] <- %p [%zx] = %zx\n", (void*)bheader->prev, old_size, (void*)bheader, bheader->size, bheader->size);
-				/*
-				 * If we coalesced backwards, we are done.
-				 */
-				return;
-			}
-		}
-#endif
-		/*
-		 * Push new space back into the stack.
-		 */
-		klmalloc_stack_push((klmalloc_bin_header *)bheader, (void *)((u32int)bheader + sizeof(klmalloc_big_bin_header)));
-		ASSERT(bheader->head != NULL);
-		/*
-		 * Insert the block into list of available slabs.
-		 */
-		klmalloc_skip_list_insert(bheader);
+		klmalloc_big_release(bheader);
 	} else {
 		/*
 		 * If the stack is empty, we are freeing
@@ -864,6 +1165,22 @@ static void * klvalloc(u32int size) {
 	return out;
 }
 /* }}} */
+/* Page blocks {{{ */
+/*
+ * A big bin block that fills exactly one page, for allocators that cut
+ * pages up themselves. The block starts page_block_offset() bytes into
+ * its page, behind the big bin header, and goes back with free().
+ */
+void * alloc_page_block(void) {
+	void * ret = malloc(PAGE_SIZE - sizeof(klmalloc_big_bin_header));
+	ASSERT(ret == NULL || ((u32int)ret & PAGE_MASK) == sizeof(klmalloc_big_bin_header));
+	return ret;
+}
+
+u32int page_block_offset(void) {
+	return sizeof(klmalloc_big_bin_header);
+}
+/* }}} */
 /* realloc() {{{ */
 static void * klrealloc(void *ptr, u32int size) {
 	/*
@@ -871,7 +1188,7 @@ static void * klrealloc(void *ptr, u32int size) {
 	 * simply malloc the requested size and return a pointer to that.
 	 */
 	if (__builtin_expect(ptr == NULL, 0))
-		return malloc(size);
+		return klmalloc(size);
 
 	/*
 	 * C standard implementation: For a size of zero, free the
@@ -879,7 +1196,7 @@ static void * klrealloc(void *ptr, u32int size) {
 	 */
 	if (__builtin_expect(size == 0, 0))
 	{
-		free(ptr);
+		klfree(ptr);
 		return NULL;
 	}
 
@@ -959,3 +1276,240 @@ static void * klcalloc(u32int nmemb, u32int size) {
 	return ptr;
 }
 /* }}} */
+/* Magazines {{{ */
+
+/*
+ * Magazines are small stacks of ready small-bin objects per size class,
+ * one set for normal code and one for interrupt handlers.
+ *
+ * The normal set lets malloc and free skip the lock; it is refilled and
+ * flushed half at a time under mem_lock.
+ *
+ * Interrupt handlers can not wait for mem_lock: the code they interrupted
+ * may hold it. They pop from their own set, only try the lock when it is
+ * empty and give up instead of spinning. Even with the lock they only take
+ * a cell from a bin that already exists: sbrk, trim and the first touch of
+ * a fresh page edit page tables and the buddy allocator, which mem_lock
+ * does not cover. Their set is refilled from refill_irq_magazines() in
+ * normal context, for classes handlers asked for. Frees never call klfree:
+ * they go back to the magazine or, when it is full, to a deferred list
+ * linked through the objects themselves.
+ */
+typedef struct _klmalloc_magazine {
+	void * objects[MAGAZINE_SIZE];
+	u32int count;
+	u32int wanted;							/* An interrupt handler asked for this class. */
+} klmalloc_magazine;
+
+static klmalloc_magazine klmalloc_magazines[2][NUM_BINS - 1];
+static void * klmalloc_deferred = NULL;	/* Frees from interrupt handlers waiting for the lock. */
+
+/*
+ * Small bin index of an allocated pointer, BIG_BIN for anything else.
+ * Small bin headers never change once made, so no lock is needed.
+ */
+static u32int klmalloc_ptr_bin(void * ptr) {
+	if ((u32int)ptr % PAGE_SIZE == 0)
+		return BIG_BIN;
+	klmalloc_bin_header * header = (klmalloc_bin_header *)((u32int)ptr & (u32int)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC || header->size >= BIG_BIN)
+		return BIG_BIN;
+	return header->size;
+}
+
+/*
+ * Free whatever interrupt handlers left behind. Needs mem_lock.
+ */
+static void klmalloc_drain_deferred(void) {
+	u32int eflags = irq_save();
+	void * ptr = klmalloc_deferred;
+	klmalloc_deferred = NULL;
+	irq_restore(eflags);
+	while (ptr) {
+		void * next = *(void **)ptr;
+		if (klmalloc_is_large(ptr)) {
+			klmalloc_account_free(ptr);
+			vfree(ptr);
+		} else {
+			klfree(ptr);
+		}
+		ptr = next;
+	}
+}
+
+static void * klmalloc_magazine_alloc(u32int size) {
+	if (__builtin_expect(size == 0, 0))
+		return NULL;
+	u32int bin = klmalloc_bin_size(size);
+	if (bin >= BIG_BIN)
+		return NULL;
+	klmalloc_magazine * mag = &klmalloc_magazines[MAGAZINE_NORMAL][bin];
+	if (mag->count == 0) {
+		mutex_lock(&mem_lock);
+		klmalloc_drain_deferred();
+		while (mag->count < MAGAZINE_SIZE / 2) {
+			void * ptr = klmalloc(size);
+			if (!ptr)
+				break;
+			mag->objects[mag->count++] = ptr;
+		}
+		mutex_unlock(&mem_lock);
+		if (mag->count == 0)
+			return NULL;
+	}
+	return mag->objects[--mag->count];
+}
+
+static int klmalloc_magazine_free(void * ptr) {
+	if (__builtin_expect(ptr == NULL, 0))
+		return 1;
+	u32int bin = klmalloc_ptr_bin(ptr);
+	if (bin >= BIG_BIN)
+		return 0;
+	klmalloc_magazine * mag = &klmalloc_magazines[MAGAZINE_NORMAL][bin];
+	if (mag->count == MAGAZINE_SIZE) {
+		mutex_lock(&mem_lock);
+		klmalloc_drain_deferred();
+		while (mag->count > MAGAZINE_SIZE / 2)
+			klfree(mag->objects[--mag->count]);
+		mutex_unlock(&mem_lock);
+	}
+	mag->objects[mag->count++] = ptr;
+	return 1;
+}
+
+/*
+ * A cell of a small bin that already exists, NULL when every bin of the
+ * class is full. Never grows the heap. Needs mem_lock.
+ */
+static void * klmalloc_existing_cell(u32int bin) {
+	klmalloc_bin_header * bin_header = klmalloc_list_head(&klmalloc_bin_head[bin]);
+	if (!bin_header)
+		return NULL;
+	void * item = klmalloc_stack_pop(bin_header);
+	if (klmalloc_stack_empty(bin_header))
+		klmalloc_list_decouple(&klmalloc_bin_head[bin], bin_header);
+	return item;
+}
+
+static void * klmalloc_irq(u32int size) {
+	if (__builtin_expect(size == 0, 0))
+		return NULL;
+	u32int bin = klmalloc_bin_size(size);
+	if (bin >= BIG_BIN)
+		return NULL;
+	klmalloc_magazine * mag = &klmalloc_magazines[MAGAZINE_IRQ][bin];
+	void * ptr = NULL;
+	u32int eflags = irq_save();
+	mag->wanted = 1;
+	if (mag->count)
+		ptr = mag->objects[--mag->count];
+	irq_restore(eflags);
+	if (ptr || !mutex_trylock(&mem_lock))
+		return ptr;
+	ptr = klmalloc_existing_cell(bin);
+	mutex_unlock(&mem_lock);
+	return ptr;
+}
+
+static void klfree_irq(void * ptr) {
+	if (__builtin_expect(ptr == NULL, 0))
+		return;
+	/*
+	 * Unmapping takes other locks; anything outside the heap always
+	 * waits for normal context and is counted as freed there.
+	 */
+	if (!heap_contains(ptr)) {
+		u32int eflags = irq_save();
+		*(void **)ptr = klmalloc_deferred;
+		klmalloc_deferred = ptr;
+		irq_restore(eflags);
+		return;
+	}
+	klmalloc_account_free(ptr);
+	u32int bin = klmalloc_ptr_bin(ptr);
+	u32int eflags = irq_save();
+	if (bin < BIG_BIN && klmalloc_magazines[MAGAZINE_IRQ][bin].count < MAGAZINE_SIZE) {
+		klmalloc_magazine * mag = &klmalloc_magazines[MAGAZINE_IRQ][bin];
+		mag->objects[mag->count++] = ptr;
+	} else {
+		*(void **)ptr = klmalloc_deferred;
+		klmalloc_deferred = ptr;
+	}
+	irq_restore(eflags);
+}
+
+/*
+ * Top up the interrupt magazines. Called from normal context only;
+ * cheap when there is nothing to do.
+ */
+void refill_irq_magazines(void) {
+	u32int bin, work = (klmalloc_deferred != NULL);
+	for (bin = 0; bin < BIG_BIN && !work; ++bin) {
+		klmalloc_magazine * mag = &klmalloc_magazines[MAGAZINE_IRQ][bin];
+		work = mag->wanted && mag->count < MAGAZINE_SIZE;
+	}
+	if (!work || in_irq())
+		return;
+
+	mutex_lock(&mem_lock);
+	klmalloc_drain_deferred();
+	for (bin = 0; bin < BIG_BIN; ++bin) {
+		klmalloc_magazine * mag = &klmalloc_magazines[MAGAZINE_IRQ][bin];
+		if (!mag->wanted)
+			continue;
+		while (mag->count < MAGAZINE_SIZE) {
+			void * ptr = klmalloc(SMALLEST_BIN << bin);
+			if (!ptr)
+				break;
+			u32int eflags = irq_save();
+			if (mag->count < MAGAZINE_SIZE) {
+				mag->objects[mag->count++] = ptr;
+				ptr = NULL;
+			}
+			irq_restore(eflags);
+			if (ptr)
+				klfree(ptr);
+		}
+	}
+	mutex_unlock(&mem_lock);
+}
+/* }}} */
+/* Large allocations {{{ */
+
+/*
+ * Requests of LARGE_ALLOC_SIZE and up skip the bins and get a vmalloc
+ * region of their own, so free() hands the frames back right away and
+ * realloc() resizes by remapping pages. vmalloc never returns heap
+ * addresses; anything else outside the heap is a stray pointer and is
+ * left to klfree's magic check. Takes vm_lock, so interrupt handlers
+ * only test heap_contains() and defer the rest.
+ */
+static int klmalloc_is_large(void * ptr) {
+	return ptr != NULL && !heap_contains(ptr) && vmalloc_size(ptr) != 0;
+}
+
+static void * klmalloc_large(u32int size) {
+	return vmalloc((size + PAGE_MASK) / PAGE_SIZE);
+}
+
+static void * klrealloc_large(void * ptr, u32int size) {
+	if (size >= LARGE_ALLOC_SIZE)
+		return vrealloc(ptr, (size + PAGE_MASK) / PAGE_SIZE);
+	if (size == 0) {
+		vfree(ptr);
+		return NULL;
+	}
+	/*
+	 * Shrinking below the threshold moves the block back to the bins.
+	 */
+	mutex_lock(&mem_lock);
+	void * newptr = klmalloc(size);
+	mutex_unlock(&mem_lock);
+	if (newptr) {
+		memcpy(newptr, ptr, size);
+		vfree(ptr);
+	}
+	return newptr;
+}
+/* }}} */
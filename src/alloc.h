@@ -0,0 +1,18 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include "common.h"
+
+void* malloc(u32int size);
+void* realloc(void *ptr, u32int size);
+void* calloc(u32int nmemb, u32int size);
+void* valloc(u32int size);
+void* memalign(u32int alignment, u32int size);
+void* aligned_alloc(u32int alignment, u32int size);
+void  free(void *ptr);
+void* alloc_page_block();
+u32int page_block_offset();
+void  refill_irq_magazines();
+void  print_alloc_info();
+
+#endif //ALLOC_H
@@ -0,0 +1,54 @@
+#include "checksum.h"
+#include "cpu.h"
+
+static u32int crc32c_table[256];
+
+static u32int crc32c_soft(u32int crc, const u8int *p, size_t n)
+{
+        while (n--) {
+                crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+}
+
+//sse4.2 crc32 instruction uses the same polynomial
+static u32int crc32c_sse42(u32int crc, const u8int *p, size_t n)
+{
+        for (; n > 0 && ((size_t)p & 3); n--, p++) {
+                asm("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+        }
+        for (; n >= 4; n -= 4, p += 4) {
+                asm("crc32l %1, %0" : "+r"(crc) : "rm"(*(const u32int*)p));
+        }
+        for (; n > 0; n--, p++) {
+                asm("crc32b %1, %0" : "+r"(crc) : "rm"(*p));
+        }
+        return crc;
+}
+
+static const cpu_variant_t crc32c_variants[] = {
+        { CPU_FEATURE_SSE4_2, crc32c_sse42, "sse4.2 crc32" },
+        { CPU_FEATURE_ANY,    crc32c_soft,  "table"        },
+};
+
+static u32int (*crc32c_impl)(u32int crc, const u8int *p, size_t n) = crc32c_soft;
+
+void init_checksum()
+{
+        u32int i, bit, crc;
+
+        for (i = 0; i < 256; i++) {
+                crc = i;
+                for (bit = 0; bit < 8; bit++) {
+                        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+                }
+                crc32c_table[i] = crc;
+        }
+        crc32c_impl = (u32int (*)(u32int, const u8int*, size_t))cpu_select("crc32c", crc32c_variants);
+}
+
+//crc is 0 for a new checksum or the result of the previous chunk
+u32int crc32c(u32int crc, const void *buf, size_t n)
+{
+        return ~crc32c_impl(~crc, (const u8int*)buf, n);
+}
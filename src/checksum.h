@@ -0,0 +1,12 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "common.h"
+
+//castagnoli polynomial, reflected
+#define CRC32C_POLY 0x82F63B78
+
+void   init_checksum();
+u32int crc32c(u32int crc, const void *buf, size_t n);
+
+#endif //CHECKSUM_H
@@ -1,5 +1,6 @@
 #include "common.h"
 #include "screen.h"
+#include "cpu.h"
 
 void outb(u16int port, u8int value)
 {
@@ -20,49 +21,213 @@ u16int inw(u16int port)
         return ret;
 }
 
-void *memset(void *s, int c, size_t n)
+#define STRING_REP_MIN  64 //below this rep setup and the es reload cost more than a plain loop
+
+//rep string ops store through es, the kernel keeps it on the video segment
+static void rep_stos(u8int *dst, u32int fill, size_t n)
+{
+        size_t words = n >> 2, tail = n & 3;
+        u32int es, tmp;
+        asm volatile("mov  %%es,     %k[es]    \n\t"
+                     "mov  %%ds,     %k[tmp]   \n\t"
+                     "mov  %k[tmp],  %%es      \n\t"
+                     "rep  stosl               \n\t"
+                     "mov  %[tail],  %[count]  \n\t"
+                     "rep  stosb               \n\t"
+                     "mov  %k[es],   %%es      \n\t"
+                     : [dst] "+D"(dst), [count] "+c"(words), [es] "=&r"(es), [tmp] "=&r"(tmp)
+                     : "a"(fill), [tail] "r"(tail)
+                     : "memory");
+}
+
+static void rep_movs(u8int *dst, const u8int *src, size_t n)
+{
+        size_t words = n >> 2, tail = n & 3;
+        u32int es, tmp;
+        asm volatile("mov  %%es,     %k[es]    \n\t"
+                     "mov  %%ds,     %k[tmp]   \n\t"
+                     "mov  %k[tmp],  %%es      \n\t"
+                     "rep  movsl               \n\t"
+                     "mov  %[tail],  %[count]  \n\t"
+                     "rep  movsb               \n\t"
+                     "mov  %k[es],   %%es      \n\t"
+                     : [dst] "+D"(dst), [src] "+S"(src), [count] "+c"(words), [es] "=&r"(es), [tmp] "=&r"(tmp)
+                     : [tail] "r"(tail)
+                     : "memory");
+}
+
+//fast strings (erms) move whole blocks with byte ops, no head or tail needed
+static void rep_stosb(u8int *dst, u32int fill, size_t n)
+{
+        u32int es, tmp;
+        asm volatile("mov  %%es,     %k[es]    \n\t"
+                     "mov  %%ds,     %k[tmp]   \n\t"
+                     "mov  %k[tmp],  %%es      \n\t"
+                     "rep  stosb               \n\t"
+                     "mov  %k[es],   %%es      \n\t"
+                     : [dst] "+D"(dst), [count] "+c"(n), [es] "=&r"(es), [tmp] "=&r"(tmp)
+                     : "a"(fill)
+                     : "memory");
+}
+
+static void rep_movsb(u8int *dst, const u8int *src, size_t n)
+{
+        u32int es, tmp;
+        asm volatile("mov  %%es,     %k[es]    \n\t"
+                     "mov  %%ds,     %k[tmp]   \n\t"
+                     "mov  %k[tmp],  %%es      \n\t"
+                     "rep  movsb               \n\t"
+                     "mov  %k[es],   %%es      \n\t"
+                     : [dst] "+D"(dst), [src] "+S"(src), [count] "+c"(n), [es] "=&r"(es), [tmp] "=&r"(tmp)
+                     :
+                     : "memory");
+}
+
+//dst and src point one past the end. Backward string ops (std) never take the
+//fast strings path, so this is a plain loop with dword stores aligned on dst
+static void copy_backward(u8int *q, const u8int *p, size_t n)
+{
+        while ((size_t)q & 3) {
+                *--q = *--p;
+                --n;
+        }
+        //a whole chunk is loaded before it is stored, the stores only hit source bytes already read
+        for (; n >= 16; n -= 16) {
+                u32int a, b, c, d;
+                p -= 16;
+                q -= 16;
+                a = ((const u32int*)p)[3];
+                b = ((const u32int*)p)[2];
+                c = ((const u32int*)p)[1];
+                d = ((const u32int*)p)[0];
+                ((u32int*)q)[3] = a;
+                ((u32int*)q)[2] = b;
+                ((u32int*)q)[1] = c;
+                ((u32int*)q)[0] = d;
+        }
+        for (; n >= 4; n -= 4) {
+                p -= 4;
+                q -= 4;
+                *(u32int*)q = *(const u32int*)p;
+        }
+        while (n--) {
+                *--q = *--p;
+        }
+}
+
+//block routines take at least STRING_REP_MIN bytes and align dst themselves
+static void fill_dwords(u8int *p, u32int fill, size_t n)
+{
+        while ((size_t)p & 3) {
+                *p++ = fill;
+                --n;
+        }
+        rep_stos(p, fill, n);
+}
+
+static void copy_dwords(u8int *q, const u8int *p, size_t n)
+{
+        while ((size_t)q & 3) {
+                *q++ = *p++;
+                --n;
+        }
+        rep_movs(q, p, n);
+}
+
+//no non-temporal tier: dword movnti and 16-byte movntdq both lost to rep movs from 4 MiB up
+static const cpu_variant_t fill_variants[] = {
+        { CPU_FEATURE_ERMS, rep_stosb,   "rep stosb" },
+        { CPU_FEATURE_ANY,  fill_dwords, "rep stosd" },
+};
+
+static const cpu_variant_t copy_variants[] = {
+        { CPU_FEATURE_ERMS, rep_movsb,   "rep movsb" },
+        { CPU_FEATURE_ANY,  copy_dwords, "rep movsd" },
+};
+
+static void (*fill_block)(u8int *p, u32int fill, size_t n)    = fill_dwords;
+static void (*copy_block)(u8int *q, const u8int *p, size_t n) = copy_dwords;
+
+//needs init_cpu, until then every block goes through rep movsd/stosd
+void init_string_ops()
+{
+        fill_block = (void (*)(u8int*, u32int, size_t))cpu_select("memset", fill_variants);
+        copy_block = (void (*)(u8int*, const u8int*, size_t))cpu_select("memcpy", copy_variants);
+}
+
+//no global state, the loader runs them from the kernel image before its segments exist
+void *memset_rep(void *s, int c, size_t n)
 {
         u8int *p = (u8int *)s;
-        u8int *end = p + n;
 
-        while (p != end) {
-                *p++ = c;
+        if (n < STRING_REP_MIN) {
+                while (n--) {
+                        *p++ = c;
+                }
+                return s;
         }
+        fill_dwords(p, (u8int)c * 0x01010101, n);
 
         return s;
 }
 
-void *memcpy(void *dst, const void *src, size_t n)
+void *memcpy_rep(void *dst, const void *src, size_t n)
 {
-        u8int *p = (u8int*)src;
+        const u8int *p = (const u8int*)src;
         u8int *q = (u8int*)dst;
-        u8int *end = p + n;
 
-        while (p != end) {
-                *q++ = *p++;
+        if (n < STRING_REP_MIN) {
+                while (n--) {
+                        *q++ = *p++;
+                }
+                return dst;
         }
+        copy_dwords(q, p, n);
 
         return dst;
 }
 
+void *memset(void *s, int c, size_t n)
+{
+        if (n < STRING_REP_MIN) {
+                return memset_rep(s, c, n);
+        }
+
+        fill_block((u8int*)s, (u8int)c * 0x01010101, n);
+
+        return s;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+        if (n < STRING_REP_MIN) {
+                return memcpy_rep(dst, src, n);
+        }
+
+        copy_block((u8int*)dst, (const u8int*)src, n);
+
+        return dst;
+}
+
+//forward copies never overwrite unread source bytes when dst is below src
 void *memmove(void *dst, const void *src, size_t n)
 {
-        u8int *p = (u8int*)src;
+        const u8int *p = (const u8int*)src;
         u8int *q = (u8int*)dst;
-        u8int *end = p + n;
 
-        if (q > p && q < end) {
-                p = end;
-                q += n;
+        if (q <= p || q >= p + n) {
+                return memcpy(dst, src, n);
+        }
 
-                while (p != src) {
+        if (n < STRING_REP_MIN) {
+                p += n;
+                q += n;
+                while (n--) {
                         *--q = *--p;
                 }
-        } else {
-                while (p != end) {
-                        *q++ = *p++;
-                }
+                return dst;
         }
+        copy_backward(q + n, p + n, n);
 
         return dst;
 }
@@ -24,8 +24,11 @@ void   outb(u16int port, u8int value);
 u8int  inb(u16int port);
 u16int inw(u16int port);
 
+void   init_string_ops();
 void  *memset(void *s, int c, size_t n);
 void  *memcpy(void *dst, const void *src, size_t n);
+void  *memset_rep(void *s, int c, size_t n);
+void  *memcpy_rep(void *dst, const void *src, size_t n);
 void  *memmove(void *dst, const void *src, size_t n);
 void  *memchr(const void *buf, int c, size_t n);
 int    memcmp(const void *s1, const void *s2, size_t n);
@@ -0,0 +1,145 @@
+#include "cpu.h"
+#include "panic.h"
+
+#define EFLAGS_ID 0x200000
+
+typedef struct cpu_selection_struct {
+        const char *routine;
+        const char *name;
+} cpu_selection_t;
+
+static const struct {
+        u32int      feature;
+        const char *name;
+} feature_names[] = {
+        { CPU_FEATURE_FPU,    "fpu"    }, { CPU_FEATURE_PSE,    "pse"    }, { CPU_FEATURE_TSC,    "tsc"    },
+        { CPU_FEATURE_PGE,    "pge"    }, { CPU_FEATURE_PAT,    "pat"    }, { CPU_FEATURE_CLFSH,  "clflush"},
+        { CPU_FEATURE_MMX,    "mmx"    }, { CPU_FEATURE_SSE,    "sse"    }, { CPU_FEATURE_SSE2,   "sse2"   },
+        { CPU_FEATURE_SSE3,   "sse3"   }, { CPU_FEATURE_SSE4_1, "sse4.1" }, { CPU_FEATURE_SSE4_2, "sse4.2" },
+        { CPU_FEATURE_POPCNT, "popcnt" }, { CPU_FEATURE_ERMS,   "erms"   },
+};
+
+cpu_info_t cpu_info;
+
+static cpu_selection_t selections[CPU_SELECTIONS_MAX];
+static u32int          selections_count = 0;
+
+static u32int rdtsc_cycles()
+{
+        u32int low;
+        asm volatile("rdtsc" : "=a"(low) :: "edx");
+        return low;
+}
+
+//without tsc cycle counts read as 0
+static u32int no_cycles()
+{
+        return 0;
+}
+
+static const cpu_variant_t cycles_variants[] = {
+        { CPU_FEATURE_TSC, rdtsc_cycles, "rdtsc" },
+        { CPU_FEATURE_ANY, no_cycles,    "none"  },
+};
+
+u32int (*read_cycles)() = no_cycles;
+
+static void cpuid(u32int leaf, u32int *eax, u32int *ebx, u32int *ecx, u32int *edx)
+{
+        asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+//cpuid exists when the eflags id bit can be toggled
+static bool has_cpuid()
+{
+        size_t before, after;
+        asm volatile("pushf                \n\t"
+                     "pop   %0             \n\t"
+                     "mov   %0,   %1       \n\t"
+                     "xor   %2,   %0       \n\t"
+                     "push  %0             \n\t"
+                     "popf                 \n\t"
+                     "pushf                \n\t"
+                     "pop   %0             \n\t"
+                     "push  %1             \n\t"
+                     "popf                 \n\t"
+                     : "=&r"(after), "=&r"(before) : "i"(EFLAGS_ID) : "cc");
+        return ((before ^ after) & EFLAGS_ID) ? TRUE : FALSE;
+}
+
+void init_cpu()
+{
+        u32int eax, ebx, ecx, edx;
+
+        memset(&cpu_info, 0, sizeof(cpu_info));
+        memcpy(cpu_info.vendor, "unknown", 8);
+        cpu_info.cache_line = CPU_DEFAULT_LINE;
+
+        if (has_cpuid()) {
+                cpuid(0, &eax, &ebx, &ecx, &edx);
+                cpu_info.max_leaf = eax;
+                memcpy(cpu_info.vendor,     &ebx, 4);
+                memcpy(cpu_info.vendor + 4, &edx, 4);
+                memcpy(cpu_info.vendor + 8, &ecx, 4);
+        }
+
+        if (cpu_info.max_leaf >= 1) {
+                cpuid(1, &eax, &ebx, &ecx, &edx);
+                cpu_info.stepping    = eax & 0xF;
+                cpu_info.model       = (eax >> 4) & 0xF;
+                cpu_info.family      = (eax >> 8) & 0xF;
+                if (cpu_info.family == 0xF)
+                        cpu_info.family += (eax >> 20) & 0xFF;
+                if (cpu_info.family == 0x6 || cpu_info.family >= 0xF)
+                        cpu_info.model  += ((eax >> 16) & 0xF) << 4;
+                cpu_info.features[0] = edx;
+                cpu_info.features[1] = ecx;
+                if (cpu_has(CPU_FEATURE_CLFSH) && ((ebx >> 8) & 0xFF))
+                        cpu_info.cache_line = ((ebx >> 8) & 0xFF) * 8;
+        }
+
+        if (cpu_info.max_leaf >= 7) {
+                cpuid(7, &eax, &ebx, &ecx, &edx);
+                cpu_info.features[2] = ebx;
+        }
+
+        read_cycles = (u32int (*)())cpu_select("cycles", cycles_variants);
+}
+
+bool cpu_has(u32int feature)
+{
+        if (feature == CPU_FEATURE_ANY)
+                return TRUE;
+        return (cpu_info.features[(feature >> 5) - 1] & (1 << (feature & 0x1F))) ? TRUE : FALSE;
+}
+
+void *cpu_select(const char *routine, const cpu_variant_t *variants)
+{
+        while (!cpu_has(variants->feature))
+                variants++;
+
+        ASSERT(selections_count < CPU_SELECTIONS_MAX);
+        selections[selections_count].routine = routine;
+        selections[selections_count].name    = variants->name;
+        selections_count++;
+
+        return variants->func;
+}
+
+void print_cpu_info()
+{
+        u32int i;
+
+        printf("cpu: %s family %u model %u stepping %u\n", cpu_info.vendor, cpu_info.family, cpu_info.model,
+               cpu_info.stepping);
+        printf("cache line: %u bytes\n", cpu_info.cache_line);
+        printf("features:");
+        for (i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++) {
+                if (cpu_has(feature_names[i].feature))
+                        printf(" %s", feature_names[i].name);
+        }
+        printf("\nselected:");
+        for (i = 0; i < selections_count; i++) {
+                printf("\n  %s: %s", selections[i].routine, selections[i].name);
+        }
+}
@@ -0,0 +1,56 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "common.h"
+
+#define CPU_FEATURE_WORDS    3
+#define CPU_SELECTIONS_MAX   16
+#define CPU_DEFAULT_LINE     32
+
+//word of cpu_info.features plus one in the high bits, bit in the low five
+#define CPU_FEATURE(word, bit) ((((word) + 1) << 5) | (bit))
+#define CPU_FEATURE_ANY      0
+//cpuid 1, edx
+#define CPU_FEATURE_FPU      CPU_FEATURE(0, 0)
+#define CPU_FEATURE_PSE      CPU_FEATURE(0, 3)
+#define CPU_FEATURE_TSC      CPU_FEATURE(0, 4)
+#define CPU_FEATURE_PGE      CPU_FEATURE(0, 13)
+#define CPU_FEATURE_PAT      CPU_FEATURE(0, 16)
+#define CPU_FEATURE_CLFSH    CPU_FEATURE(0, 19)
+#define CPU_FEATURE_MMX      CPU_FEATURE(0, 23)
+#define CPU_FEATURE_SSE      CPU_FEATURE(0, 25)
+#define CPU_FEATURE_SSE2     CPU_FEATURE(0, 26)
+//cpuid 1, ecx
+#define CPU_FEATURE_SSE3     CPU_FEATURE(1, 0)
+#define CPU_FEATURE_SSE4_1   CPU_FEATURE(1, 19)
+#define CPU_FEATURE_SSE4_2   CPU_FEATURE(1, 20)
+#define CPU_FEATURE_POPCNT   CPU_FEATURE(1, 23)
+//cpuid 7, ebx
+#define CPU_FEATURE_ERMS     CPU_FEATURE(2, 9)
+
+typedef struct cpu_info_struct {
+        char   vendor[13];
+        u32int max_leaf;
+        u32int family;
+        u32int model;
+        u32int stepping;
+        u32int cache_line;
+        u32int features[CPU_FEATURE_WORDS];
+} cpu_info_t;
+
+//candidates go best first, the last one needs CPU_FEATURE_ANY
+typedef struct cpu_variant_struct {
+        u32int      feature;
+        void       *func;
+        const char *name;
+} cpu_variant_t;
+
+extern cpu_info_t cpu_info;
+extern u32int (*read_cycles)();
+
+void   init_cpu();
+bool   cpu_has(u32int feature);
+void  *cpu_select(const char *routine, const cpu_variant_t *variants);
+void   print_cpu_info();
+
+#endif //CPU_H
@@ -54,6 +54,7 @@ void set_kernel_stack_in_tss(u32int stack)
 static void init_gdt()
 {
         gdt_base_addr = (u32int)alloc_data_page();
+        page_info(gdt_base_addr + segments_info.data_segment.base)->flags |= PAGE_PINNED;
         gdt_entry_t *gdt_entries = (gdt_entry_t*)(gdt_base_addr);
         gdt_ptr.limit = (sizeof(gdt_entry_t) * GLOBAL_DESCRIPTOR_COUNT) - 1;
         gdt_ptr.base  = (u32int)gdt_entries + segments_info.data_segment.base;
@@ -100,6 +101,7 @@ static void init_gdt()
 static void init_idt()
 {
         idt_base_addr = (u32int)alloc_data_page();
+        page_info(idt_base_addr + segments_info.data_segment.base)->flags |= PAGE_PINNED;
         idt_entry_t *idt_entries = (idt_entry_t*)(idt_base_addr);
         idt_ptr.limit = (sizeof(idt_entry_t) * INTERRUPT_DESCRIPTOR_COUNT) - 1;
         idt_ptr.base  = (u32int)idt_entries  + segments_info.data_segment.base;
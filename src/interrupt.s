@@ -81,6 +81,7 @@ IRQ  15,    47
 
 isr_common_stub:
    pusha                    ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+   cld                      ; handlers are C code, which expects DF clear
 
    mov ax, ds
    push eax
@@ -112,6 +113,7 @@ isr_common_stub:
 
 irq_common_stub:
    pusha                    ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+   cld                      ; handlers are C code, which expects DF clear
 
    mov ax, ds
    push eax
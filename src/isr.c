@@ -2,8 +2,9 @@
 #include "panic.h"
 #include "module.h"
 
-extern module_info_t module_info;
+extern module_info_t *module_info;
 isr_t interrupt_handlers[256];
+u32int irq_nesting;
 static const char *exception_messages[32] = {
 	"Divide-by-zero error",
 	"Debug",
@@ -44,6 +45,28 @@ void register_interrupt_handler(u8int n, isr_t handler)
         interrupt_handlers[n] = handler;
 }
 
+//TRUE while a hardware interrupt handler is running
+bool in_irq()
+{
+        return irq_nesting != 0;
+}
+
+//disables interrupts, returns eflags for irq_restore
+u32int irq_save()
+{
+        u32int eflags;
+        asm volatile("pushf         \n\t"
+                     "pop  %0       \n\t"
+                     "cli           \n\t" : "=r"(eflags) :: "memory");
+        return eflags;
+}
+
+void irq_restore(u32int eflags)
+{
+        if (eflags & 0x200)
+                IRQ_RES;
+}
+
 void isr_handler(registers_t regs)
 {
         // This line is important. When the processor extends the 8-bit interrupt number
@@ -54,10 +77,11 @@ void isr_handler(registers_t regs)
                 isr_t handler = interrupt_handlers[int_no];
                 handler(&regs);
         } else {
-                char *place = (module_info.running)? "module" : "kernel";
+                bool  in_module = module_info != NULL && module_info->running;
+                char *place = (in_module)? "module" : "kernel";
                 printf("0x%x:%s in %s\n", int_no, exception_messages[int_no], place);
                 printf("(cs:0x%x  eip:0x%x  ss:0x%x  esp:0x%x  eflags:0x%x)\n", regs.cs, regs.eip, regs.ss, regs.esp, regs.eflags);
-                if (module_info.running)
+                if (in_module)
                         exit_module();
                 PANIC("unhandled interrupt...");
         }
@@ -76,7 +100,9 @@ void irq_handler(registers_t regs)
 
         if (interrupt_handlers[regs.int_no] != 0) {
                 isr_t handler = interrupt_handlers[regs.int_no];
+                irq_nesting++;
                 handler(&regs);
+                irq_nesting--;
         }
 
 }
@@ -31,5 +31,8 @@ typedef struct registers_struct {
 typedef void (*isr_t)(registers_t*);
 
 void register_interrupt_handler(u8int n, isr_t handler);
+bool in_irq();
+u32int irq_save();
+void irq_restore(u32int eflags);
 
 #endif //ISR_H
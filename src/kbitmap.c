@@ -44,3 +44,114 @@ u32int first_clear_bit(u8int *bitmap, u32int size)
 
         return -1;
 }
+
+
+#define WORD_BITS 32
+#define FULL_WORD 0xFFFFFFFF
+
+static u32int words_count(u32int bits)
+{
+        return (bits % WORD_BITS) ? (bits / WORD_BITS) + 1 : (bits / WORD_BITS);
+}
+
+static u32int bit_scan_forward(u32int word)
+{
+        u32int index;
+        asm("bsfl %1, %0" : "=r"(index) : "rm"(word));
+        return index;
+}
+
+u32int kbitmap_storage_size(u32int size)
+{
+        u32int level, words = size, total = 0;
+        for (level = 0; level < KBITMAP_LEVELS; level++) {
+                words  = words_count(words);
+                total += words;
+        }
+
+        return total * sizeof(u32int);
+}
+
+void kbitmap_init(kbitmap_t *bitmap, void *storage, u32int size, bool used)
+{
+        u32int level, index, words = size;
+        u32int *ptr = (u32int*)storage;
+        bitmap->size = size;
+        for (level = 0; level < KBITMAP_LEVELS; level++) {
+                words                  = words_count(words);
+                bitmap->levels[level]  = ptr;
+                bitmap->words[level]   = words;
+                ptr                   += words;
+        }
+        //items
+        memset(bitmap->levels[0], used ? 0xFF : 0x0, bitmap->words[0] * sizeof(u32int));
+        for (index = size; index < bitmap->words[0] * WORD_BITS; index++) {
+                bitmap->levels[0][index / WORD_BITS] |= (1U << (index % WORD_BITS));
+        }
+        //summaries
+        for (level = 1; level < KBITMAP_LEVELS; level++) {
+                memset(bitmap->levels[level], 0x0, bitmap->words[level] * sizeof(u32int));
+                for (index = 0; index < bitmap->words[level - 1]; index++) {
+                        u32int lower = bitmap->levels[level - 1][index];
+                        if ((level == 1) ? (lower != FULL_WORD) : (lower != 0))
+                                bitmap->levels[level][index / WORD_BITS] |= (1U << (index % WORD_BITS));
+                }
+        }
+}
+
+void kbitmap_set(kbitmap_t *bitmap, u32int num)
+{
+        u32int  level, index = num / WORD_BITS;
+        u32int *word         = &bitmap->levels[0][index];
+        if (*word == FULL_WORD)
+                return;
+
+        *word |= (1U << (num % WORD_BITS));
+        //word is full now - drop its summary bit, go up while summary words become empty
+        for (level = 1; (level < KBITMAP_LEVELS) && (*word == ((level == 1) ? FULL_WORD : 0)); level++) {
+                word   = &bitmap->levels[level][index / WORD_BITS];
+                *word &= ~(1U << (index % WORD_BITS));
+                index /= WORD_BITS;
+        }
+}
+
+void kbitmap_clear(kbitmap_t *bitmap, u32int num)
+{
+        u32int  level, index = num / WORD_BITS;
+        u32int *word         = &bitmap->levels[0][index];
+        bool    was_full     = (*word == FULL_WORD);
+
+        *word &= ~(1U << (num % WORD_BITS));
+        //word was full - set its summary bit, go up while summary words were empty
+        for (level = 1; (level < KBITMAP_LEVELS) && was_full; level++) {
+                word     = &bitmap->levels[level][index / WORD_BITS];
+                was_full = (*word == 0);
+                *word   |= (1U << (index % WORD_BITS));
+                index   /= WORD_BITS;
+        }
+}
+
+bool kbitmap_test(kbitmap_t *bitmap, u32int num)
+{
+        return ((bitmap->levels[0][num / WORD_BITS] & (1U << (num % WORD_BITS))) != 0)? TRUE : FALSE;
+}
+
+u32int kbitmap_first_clear(kbitmap_t *bitmap)
+{
+        u32int level = KBITMAP_LEVELS - 1;
+        u32int index;
+
+        for (index = 0; index < bitmap->words[level]; index++) {
+                if (bitmap->levels[level][index] != 0)
+                        break;
+        }
+        if (index == bitmap->words[level])
+                return -1;
+
+        //every summary bit points to a word with a clear bit
+        for (; level > 0; level--) {
+                index = (index * WORD_BITS) + bit_scan_forward(bitmap->levels[level][index]);
+        }
+
+        return (index * WORD_BITS) + bit_scan_forward(~bitmap->levels[0][index]);
+}
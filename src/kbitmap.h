@@ -3,10 +3,27 @@
 
 #include "common.h"
 
+#define KBITMAP_LEVELS 3
+
+//levels[0] holds one bit per item (1 - used), every upper level holds one bit
+//per word of the level below (1 - that word still has a clear bit)
+typedef struct kbitmap_struct {
+        u32int *levels[KBITMAP_LEVELS];
+        u32int  words[KBITMAP_LEVELS];
+        u32int  size;
+} kbitmap_t;
+
 u32int  bitmap_in_bytes(u32int size);
 void    set_bit(u8int *bitmap, u32int num);
 void    clear_bit(u8int *bitmap, u32int num);
 bool    test_bit(u8int *bitmap, u32int num);
 u32int  first_clear_bit(u8int *bitmap, u32int size);
 
+u32int  kbitmap_storage_size(u32int size);
+void    kbitmap_init(kbitmap_t *bitmap, void *storage, u32int size, bool used);
+void    kbitmap_set(kbitmap_t *bitmap, u32int num);
+void    kbitmap_clear(kbitmap_t *bitmap, u32int num);
+bool    kbitmap_test(kbitmap_t *bitmap, u32int num);
+u32int  kbitmap_first_clear(kbitmap_t *bitmap);
+
 #endif //KBITMAP_H
@@ -1,6 +1,7 @@
 #include "keyboard.h"
 #include "mutex.h"
 #include "isr.h"
+#include "alloc.h"
 
 #define KEY_CACHE_SIZE 256
 DEFINE_MUTEX(key_loc_mtx);
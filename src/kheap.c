@@ -2,39 +2,63 @@
 #include "panic.h"
 #include "paging.h"
 #include "memory_manager.h"
+#include "module_loader.h"
 
 extern segments_info_t   segments_info;
-extern u32int            page_tables_rel_virt_addr;
+extern memory_bitmap_t   memory_bitmap;
+extern u32int            kmap_rel_virt_addr;
 u32int                   heap_start_rel_virt_addr;
 u32int                   heap_brk;
 u32int                   heap_size;
 
 
+//heap may span many page tables: it is limited by half of the free virtual space and by free memory
 void init_heap()
 {
-        heap_start_rel_virt_addr    = page_tables_rel_virt_addr + PAGE_SIZE * 1024;
+        heap_start_rel_virt_addr    = kmap_rel_virt_addr + PAGE_SIZE;
+        //keep clear of the module data window
+        u32int module_data_end      = MODULE_DATA_LOAD_ADDR + segments_info.module_segment.len;
+        if (segments_info.module_segment.len > 0 && heap_start_rel_virt_addr < module_data_end)
+                heap_start_rel_virt_addr = (module_data_end + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
         u32int free_virt_space_size = (segments_info.data_segment.len - heap_start_rel_virt_addr);
-        heap_size            = (free_virt_space_size / 2) & 0xFFFFF000;
-        heap_size                   =  (heap_size > PAGE_SIZE * 1024) ? PAGE_SIZE * 1024 : heap_size;
+        u32int free_memory_size     = memory_bitmap.zone.free_pages_count * PAGE_SIZE;
+        heap_size                   = (free_virt_space_size / 2) & 0xFFFFF000;
+        heap_size                   = (heap_size > free_memory_size) ? free_memory_size : heap_size;
         heap_brk                    = heap_start_rel_virt_addr;
 }
 
-void* sbrk(u32int increment)
+//negative increment gives the tail pages back, returns the previous break
+void* sbrk(s32int increment)
 {
+        u32int address = heap_brk;
         ASSERT(increment % PAGE_SIZE == 0);
         ASSERT(heap_brk  % PAGE_SIZE == 0);
-        ASSERT(heap_brk + increment < heap_start_rel_virt_addr + heap_size);
-        u32int address = heap_brk;
-        u32int i, *ptr;
-        for (i = heap_brk; i < heap_brk + increment; i += PAGE_SIZE) {
-                ptr = alloc_data_page();
-                ASSERT(ptr != NULL);
-                mmap(segments_info.data_segment, i, (u32int)ptr, TRUE, FALSE);
+        if (increment >= 0) {
+                ASSERT(heap_brk + increment < heap_start_rel_virt_addr + heap_size);
+                //demand-zero: frames are allocated on first write
+                bool   mapped  = mmap_zero_range(heap_brk, increment / PAGE_SIZE, FALSE);
+                ASSERT(mapped);
+        } else {
+                ASSERT(heap_brk + increment >= heap_start_rel_virt_addr);
+                munmap_range(segments_info.data_segment, heap_brk + increment, -increment / PAGE_SIZE);
         }
 
         heap_brk += increment;
-        memset((void *)address, 0x0, increment);
 
         return (void *)address;
 }
 
+//true for addresses inside the heap window, mapped or not
+bool heap_contains(void *address)
+{
+        return (u32int)address >= heap_start_rel_virt_addr && (u32int)address < heap_start_rel_virt_addr + heap_size;
+}
+
+//frames of free heap pages go back, the pages stay readable as zeroes
+void heap_release_pages(void *address, u32int pages_count)
+{
+        ASSERT((u32int)address % PAGE_SIZE == 0);
+        ASSERT((u32int)address >= heap_start_rel_virt_addr && (u32int)address + pages_count * PAGE_SIZE <= heap_brk);
+        bool mapped = mmap_zero_range((u32int)address, pages_count, FALSE);
+        ASSERT(mapped);
+}
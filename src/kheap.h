@@ -4,6 +4,8 @@
 #include "common.h"
 
 void  init_heap();
-void* sbrk(u32int increment);
+void* sbrk(s32int increment);
+void  heap_release_pages(void *address, u32int pages_count);
+bool  heap_contains(void *address);
 
 #endif //KHEAP_H
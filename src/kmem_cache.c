@@ -0,0 +1,214 @@
+#include "kmem_cache.h"
+#include "alloc.h"
+#include "panic.h"
+#include "mutex.h"
+#include "screen.h"
+
+//descriptors of all other caches are allocated from this one
+static kmem_cache_t  cache_cache;
+static kmem_cache_t *caches;
+DEFINE_MUTEX(kmem_lock);
+
+static void** object_link(kmem_cache_t *cache, void *object)
+{
+        return (void**)((u32int)object + cache->link_offset);
+}
+
+static void slab_list_remove(kmem_slab_t **list, kmem_slab_t *slab)
+{
+        if (slab->prev != NULL)
+                slab->prev->next = slab->next;
+        else
+                *list = slab->next;
+        if (slab->next != NULL)
+                slab->next->prev = slab->prev;
+        slab->next = slab->prev = NULL;
+}
+
+static void slab_list_insert(kmem_slab_t **list, kmem_slab_t *slab)
+{
+        slab->prev = NULL;
+        slab->next = *list;
+        if (*list != NULL)
+                (*list)->prev = slab;
+        *list = slab;
+}
+
+static u32int slab_page(kmem_slab_t *slab)
+{
+        return (u32int)slab - page_block_offset();
+}
+
+static kmem_slab_t* slab_of(void *object)
+{
+        kmem_slab_t *slab = (kmem_slab_t*)(((u32int)object & ~(PAGE_SIZE - 1)) + page_block_offset());
+        ASSERT(slab->magic == KMEM_SLAB_MAGIC);
+
+        return slab;
+}
+
+//objects are constructed once per slab, not on every allocation
+static kmem_slab_t* grow_cache(kmem_cache_t *cache)
+{
+        kmem_slab_t *slab = (kmem_slab_t*)alloc_page_block();
+        if (slab == NULL)
+                return NULL;
+
+        slab->magic        = KMEM_SLAB_MAGIC;
+        slab->cache        = cache;
+        slab->used         = 0;
+        slab->free_objects = NULL;
+        u32int i = cache->objects_per_slab;
+        while (i-- > 0) {
+                void *object = (void*)(slab_page(slab) + cache->first_offset + i * cache->slot_size);
+                if (cache->ctor != NULL)
+                        cache->ctor(object);
+                *object_link(cache, object) = slab->free_objects;
+                slab->free_objects = object;
+        }
+        cache->slabs_count++;
+
+        return slab;
+}
+
+static bool setup_cache(kmem_cache_t *cache, const char *name, u32int size, u32int align, void (*ctor)(void *object))
+{
+        if (align < sizeof(void*))
+                align = sizeof(void*);
+        ASSERT((align & (align - 1)) == 0);
+
+        memset(cache, 0x0, sizeof(kmem_cache_t));
+        strncpy(cache->name, name, KMEM_CACHE_NAME_SIZE - 1);
+        cache->object_size  = size;
+        cache->ctor         = ctor;
+        cache->link_offset  = ctor != NULL ? (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1) : 0;
+        cache->slot_size    = cache->link_offset + sizeof(void*);
+        if (ctor == NULL && size > cache->slot_size)
+                cache->slot_size = size;
+        cache->slot_size    = (cache->slot_size + align - 1) & ~(align - 1);
+        cache->first_offset = (page_block_offset() + sizeof(kmem_slab_t) + align - 1) & ~(align - 1);
+        if (cache->first_offset >= PAGE_SIZE)
+                return FALSE;
+        cache->objects_per_slab = (PAGE_SIZE - cache->first_offset) / cache->slot_size;
+
+        //bigger objects should go to malloc
+        return cache->objects_per_slab >= KMEM_SLAB_MIN_OBJS;
+}
+
+kmem_cache_t* kmem_cache_create(const char *name, u32int size, u32int align, void (*ctor)(void *object))
+{
+        kmem_cache_t *cache;
+        mutex_lock(&kmem_lock);
+        if (cache_cache.objects_per_slab == 0) {
+                setup_cache(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+                cache_cache.next = NULL;
+                caches = &cache_cache;
+        }
+        mutex_unlock(&kmem_lock);
+
+        cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+        if (cache == NULL)
+                return NULL;
+        if (!setup_cache(cache, name, size, align, ctor)) {
+                kmem_cache_free(&cache_cache, cache);
+                return NULL;
+        }
+
+        mutex_lock(&kmem_lock);
+        cache->next = caches;
+        caches      = cache;
+        mutex_unlock(&kmem_lock);
+
+        return cache;
+}
+
+void* kmem_cache_alloc(kmem_cache_t *cache)
+{
+        mutex_lock(&kmem_lock);
+        kmem_slab_t *slab = cache->partial_slabs;
+        if (slab == NULL) {
+                slab = cache->empty_slabs;
+                if (slab != NULL)
+                        slab_list_remove(&cache->empty_slabs, slab);
+                else
+                        slab = grow_cache(cache);
+                if (slab == NULL) {
+                        mutex_unlock(&kmem_lock);
+                        return NULL;
+                }
+                slab_list_insert(&cache->partial_slabs, slab);
+        }
+
+        void *object = slab->free_objects;
+        slab->free_objects = *object_link(cache, object);
+        if (++slab->used == cache->objects_per_slab) {
+                slab_list_remove(&cache->partial_slabs, slab);
+                slab_list_insert(&cache->full_slabs, slab);
+        }
+        cache->active_objects++;
+        cache->allocs++;
+        mutex_unlock(&kmem_lock);
+
+        return object;
+}
+
+//one empty slab stays with the cache, further ones go back to the heap
+void kmem_cache_free(kmem_cache_t *cache, void *object)
+{
+        kmem_slab_t *released = NULL;
+        if (object == NULL)
+                return;
+
+        mutex_lock(&kmem_lock);
+        kmem_slab_t *slab = slab_of(object);
+        ASSERT(slab->cache == cache);
+        if (slab->used == cache->objects_per_slab) {
+                slab_list_remove(&cache->full_slabs, slab);
+                slab_list_insert(&cache->partial_slabs, slab);
+        }
+        *object_link(cache, object) = slab->free_objects;
+        slab->free_objects = object;
+        if (--slab->used == 0) {
+                slab_list_remove(&cache->partial_slabs, slab);
+                if (cache->empty_slabs != NULL) {
+                        released = slab;
+                        released->magic = 0;
+                        cache->slabs_count--;
+                } else {
+                        slab_list_insert(&cache->empty_slabs, slab);
+                }
+        }
+        cache->active_objects--;
+        cache->frees++;
+        mutex_unlock(&kmem_lock);
+
+        free(released);
+}
+
+void kmem_cache_shrink(kmem_cache_t *cache)
+{
+        kmem_slab_t *slab, *next;
+        mutex_lock(&kmem_lock);
+        slab = cache->empty_slabs;
+        cache->empty_slabs = NULL;
+        for (next = slab; next != NULL; next = next->next) {
+                next->magic = 0;
+                cache->slabs_count--;
+        }
+        mutex_unlock(&kmem_lock);
+
+        for (; slab != NULL; slab = next) {
+                next = slab->next;
+                free(slab);
+        }
+}
+
+void print_kmem_cache_info()
+{
+        kmem_cache_t *cache;
+        printf("caches: name, object size, slot size, objects (active/total), slabs, allocs, frees");
+        for (cache = caches; cache != NULL; cache = cache->next)
+                printf("\n  %s: %u, %u, %u/%u, %u, %u, %u", cache->name, cache->object_size, cache->slot_size,
+                       cache->active_objects, cache->slabs_count * cache->objects_per_slab,
+                       cache->slabs_count, cache->allocs, cache->frees);
+}
@@ -0,0 +1,48 @@
+#ifndef KMEM_CACHE_H
+#define KMEM_CACHE_H
+
+#include "common.h"
+
+#define KMEM_CACHE_NAME_SIZE 16
+#define KMEM_SLAB_MAGIC      0x51ABCAC4
+#define KMEM_SLAB_MIN_OBJS   4
+
+struct kmem_cache_struct;
+
+//every slab is one heap page block, its header sits right after the heap's own
+typedef struct kmem_slab_struct {
+        u32int                    magic;
+        struct kmem_cache_struct *cache;
+        struct kmem_slab_struct  *next;
+        struct kmem_slab_struct  *prev;
+        void                     *free_objects;
+        u32int                    used;
+} kmem_slab_t;
+
+//objects keep their constructed state while free, so with ctor the free
+//list link is stored past the object instead of inside it
+typedef struct kmem_cache_struct {
+        char                      name[KMEM_CACHE_NAME_SIZE];
+        u32int                    object_size;
+        u32int                    slot_size;
+        u32int                    link_offset;
+        u32int                    first_offset;
+        u32int                    objects_per_slab;
+        void                    (*ctor)(void *object);
+        kmem_slab_t              *partial_slabs;
+        kmem_slab_t              *full_slabs;
+        kmem_slab_t              *empty_slabs;
+        u32int                    slabs_count;
+        u32int                    active_objects;
+        u32int                    allocs;
+        u32int                    frees;
+        struct kmem_cache_struct *next;
+} kmem_cache_t;
+
+kmem_cache_t* kmem_cache_create(const char *name, u32int size, u32int align, void (*ctor)(void *object));
+void*         kmem_cache_alloc(kmem_cache_t *cache);
+void          kmem_cache_free(kmem_cache_t *cache, void *object);
+void          kmem_cache_shrink(kmem_cache_t *cache);
+void          print_kmem_cache_info();
+
+#endif //KMEM_CACHE_H
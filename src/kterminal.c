@@ -1,5 +1,11 @@
 #include "kterminal.h"
 #include "screen.h"
+#include "memory_manager.h"
+#include "paging.h"
+#include "vmalloc.h"
+#include "kmem_cache.h"
+#include "alloc.h"
+#include "cpu.h"
 
 #define CMD_BUF_SIZE (SCREEN_HIGH * SCREEN_WIDE)
 
@@ -22,6 +28,9 @@ void start_terminal()
                             printf("\n>> ");
                         }
 
+                } else {
+                        refill_zero_pool();
+                        refill_irq_magazines();
                 }
         }
 }
@@ -51,7 +60,19 @@ void run_cmd()
     if (!strcmp("clear", cmd_buf)) {
         clear_screen();
     } else if(!strcmp("help", cmd_buf)) {
-        printf("commands:\n  1. help\n  2. clear");
+        printf("commands:\n  1. help\n  2. clear\n  3. mem\n  4. caches\n  5. heap\n  6. cpu");
+    } else if(!strcmp("mem", cmd_buf)) {
+        print_memory_info();
+        printf("\n");
+        print_fault_info();
+        printf("\n");
+        print_vmalloc_info();
+    } else if(!strcmp("caches", cmd_buf)) {
+        print_kmem_cache_info();
+    } else if(!strcmp("heap", cmd_buf)) {
+        print_alloc_info();
+    } else if(!strcmp("cpu", cmd_buf)) {
+        print_cpu_info();
     } else {
         printf("unknown command \"%s\"", cmd_buf);
     }
@@ -1,5 +1,6 @@
 #include "multiboot.h"
 #include "descriptor_tables.h"
+#include "memory_manager.h"
 
 /*macros*/
 #define CHECK_FLAG(flags,bit)   ((flags) & (1 << (bit)))
@@ -20,11 +21,14 @@ static  u32int module_base_addr;
 static  u32int code_segment_len;
 static  u32int data_segment_len;
 static  u32int module_segment_len;
+static  u32int memory_map_rel_addr;
+static  u32int memory_map_count;
 
 /*forward declarations*/
 static multiboot_memory_map_t* get_biggest_memory_chunk(multiboot_info_t*);
 static void init_segments_parameters(multiboot_info_t*, multiboot_memory_map_t*);
 static void init_gdt();
+static void copy_memory_map(multiboot_info_t*);
 static void copy_data_and_code();
 static void goto_kernel();
 
@@ -43,9 +47,11 @@ void loader_main(multiboot_info_t *mbi, u32int magic)
                 init_segments_parameters(mbi, max_mmap);
                 //3. initialize global descriptor table
                 init_gdt();
-                //4. copy data & code kernel
+                //4. copy available memory regions for memory manager
+                copy_memory_map(mbi);
+                //5. copy data & code kernel
                 copy_data_and_code();
-                //5. set stack, load gdt and jump to kernel
+                //6. set stack, load gdt and jump to kernel
                 goto_kernel();
             }
 }
@@ -107,7 +113,7 @@ static void init_gdt()
         gdt_ptr.limit = (sizeof(gdt_entry_t) * 5) - 1;
         gdt_ptr.base  = (u32int)gdt_entries;
 
-        loader_memset = (void (*)(void*, int, size_t))((u32int)&lma + (u32int)&loader_size + memset - (u32int)&null_ptr_offset);
+        loader_memset = (void (*)(void*, int, size_t))((u32int)&lma + (u32int)&loader_size + memset_rep - (u32int)&null_ptr_offset);
         loader_memset(gdt_entries, 0x0, sizeof(gdt_entry_t) * 5);
 
         loader_set_gdt_gate = (void (*)(gdt_entry_t*, u32int, u32int, u8int, u8int))((u32int)&lma + (u32int)&loader_size + set_global_descriptor - (u32int)&null_ptr_offset);
@@ -116,9 +122,36 @@ static void init_gdt()
         loader_set_gdt_gate(gdt_entries + 2, code_base_addr,   code_segment_len >> 12, 0x9A, 0xC0); // Code   segment  - 0x10
 }
 
+static void copy_memory_map(multiboot_info_t *mbi)
+{
+        //regions are placed in data segment right after the loader gdt
+        memory_map_rel_addr = (u32int)&kernel_data_size + sizeof(gdt_entry_t) * 5;
+        memory_map_count    = 0;
+        segment_t *regions  = (segment_t*)(data_base_addr + memory_map_rel_addr);
+        multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
+        multiboot_uint32_t      end  = mbi->mmap_addr + mbi->mmap_length;
+        while ((multiboot_uint32_t)mmap < end && memory_map_count < MAX_MEMORY_REGIONS) {
+                if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap->addr < 0x100000000ULL) {
+                        multiboot_uint64_t region_end = mmap->addr + mmap->len;
+                        if (region_end > 0x100000000ULL)
+                                region_end = 0x100000000ULL;
+                        //only whole pages
+                        u32int base = (mmap->addr % PAGE_SIZE) ? ((u32int)mmap->addr & 0xFFFFF000) + PAGE_SIZE
+                                                               :  (u32int)mmap->addr;
+                        u32int top  = (region_end == 0x100000000ULL) ? 0xFFFFF000 : ((u32int)region_end & 0xFFFFF000);
+                        if (top > base) {
+                                regions[memory_map_count].base = base;
+                                regions[memory_map_count].len  = top - base;
+                                memory_map_count++;
+                        }
+                }
+                mmap = (multiboot_memory_map_t *) ((multiboot_uint32_t)mmap + mmap->size + sizeof (mmap->size));
+        }
+}
+
 static void copy_data_and_code()
 {
-        loader_memcpy = (void (*)(void*, void*, size_t))((u32int)&lma + (u32int)&loader_size + memcpy - (u32int)&null_ptr_offset);
+        loader_memcpy = (void (*)(void*, void*, size_t))((u32int)&lma + (u32int)&loader_size + memcpy_rep - (u32int)&null_ptr_offset);
         //data kernel
         u8int *kernel_data_ptr = (u8int*)((u32int)&lma + (u32int)&loader_size + (u32int)&kernel_code_size);
         loader_memcpy((void*)(data_base_addr + (u32int)&null_ptr_offset), kernel_data_ptr, (u32int)&kernel_data_size - (u32int)&null_ptr_offset);
@@ -133,13 +166,15 @@ static void goto_kernel()
         u32int kernel_stack_phys_addr = data_segment_len + data_base_addr;
 
         //pass parameters to start_kernel(...) function.
-        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 1), (void*)(&module_segment_len), sizeof(u32int));
-        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 2), (void*)(&module_base_addr),   sizeof(u32int));
-        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 3), (void*)(&data_segment_len),   sizeof(u32int));
-        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 4), (void*)(&data_base_addr),     sizeof(u32int));
-        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 5), (void*)(&code_segment_len),   sizeof(u32int));
-        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 6), (void*)(&code_base_addr),     sizeof(u32int));
-        u32int stack_base_addr = data_segment_len    - sizeof(u32int) * 7;
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 1), (void*)(&memory_map_count),    sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 2), (void*)(&memory_map_rel_addr), sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 3), (void*)(&module_segment_len),  sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 4), (void*)(&module_base_addr),    sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 5), (void*)(&data_segment_len),    sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 6), (void*)(&data_base_addr),      sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 7), (void*)(&code_segment_len),    sizeof(u32int));
+        loader_memcpy((void*)(kernel_stack_phys_addr - sizeof(u32int) * 8), (void*)(&code_base_addr),      sizeof(u32int));
+        u32int stack_base_addr = data_segment_len    - sizeof(u32int) * 9;
 
         asm volatile(
                 "lgdtl  (%0)       \n\t"
@@ -8,6 +8,8 @@ extern  u32int   kernel_code_size;
 bool             memory_bitmap_initialized = FALSE;
 segments_info_t  segments_info;
 memory_bitmap_t  memory_bitmap;
+segment_t        memory_regions[MAX_MEMORY_REGIONS];
+u32int           memory_regions_count;
 u32int           data_top_address = (u32int)&kernel_data_size;
 
 void init_segments_info(u32int code_base_addr,    u32int code_segment_len,
@@ -24,106 +26,283 @@ void init_segments_info(u32int code_base_addr,    u32int code_segment_len,
         segments_info.module_segment.len  = module_segment_len;
 }
 
-void* alloc_page(u8int* bitmap)
+//returns physical address of the block, frame 0 is never released so NULL means failure
+void* alloc_pages(page_zone_t *zone, u32int order)
 {
-        void *mem_ptr = NULL;
-        if (memory_bitmap_initialized == TRUE) {
-                u32int bitmap_size  = (bitmap == memory_bitmap.code_bitmap) ? memory_bitmap.code_size
-                                                                            : memory_bitmap.data_size;
-                u32int bitmap_index = first_clear_bit(bitmap, bitmap_size);
-                if (bitmap_index != -1) {
-                        u32int rel_free_page_address = bitmap_index * PAGE_SIZE;
-                        ASSERT((bitmap_index < bitmap_size) && (bitmap_index >= 0));
-                        set_bit(bitmap, bitmap_index);
-                        mem_ptr = (void*)rel_free_page_address;
+        u32int index, block_index, cur_order, block_order;
+        u32int page_index = -1;
+        if (memory_bitmap_initialized == FALSE || order > MAX_PAGE_ORDER)
+                return NULL;
+
+        //lowest-addressed free block big enough - keeps early kernel allocations packed above the image
+        for (cur_order = order; cur_order <= MAX_PAGE_ORDER; cur_order++) {
+                block_index = kbitmap_first_clear(&zone->free_blocks[cur_order]);
+                if (block_index != -1 && (block_index << cur_order) < page_index) {
+                        page_index  = block_index << cur_order;
+                        block_order = cur_order;
                 }
         }
+        if (page_index == -1)
+                return NULL;
 
-        return mem_ptr;
+        kbitmap_set(&zone->free_blocks[block_order], page_index >> block_order);
+        //split: upper halves go back to the lower orders
+        while (block_order > order) {
+                block_order--;
+                kbitmap_clear(&zone->free_blocks[block_order], (page_index >> block_order) + 1);
+        }
+        for (index = page_index; index < page_index + (1 << order); index++) {
+                kbitmap_set(&zone->used_pages, index);
+                zone->pages[index].refcount = 0;
+                zone->pages[index].flags    = 0x0;
+                zone->pages[index].owner    = PAGE_OWNER_NONE;
+        }
+        zone->free_pages_count -= (1 << order);
+
+        return (void*)(zone->base + page_index * PAGE_SIZE);
 }
 
-bool free_page(u32int rel_address, u8int *bitmap)
+bool free_pages(u32int address, u32int order, page_zone_t *zone)
 {
-        ASSERT((rel_address % PAGE_SIZE) == 0);
-        if (memory_bitmap_initialized == TRUE) {
-                u32int bitmap_index = rel_address / PAGE_SIZE;
-                u32int bitmap_size  = (bitmap == memory_bitmap.code_bitmap) ? memory_bitmap.code_size
-                                                                            : memory_bitmap.data_size;
-                if (bitmap_index < bitmap_size) {
-                    clear_bit(bitmap, bitmap_index);
-                    return TRUE;
+        ASSERT(((address - zone->base) % (PAGE_SIZE << order)) == 0);
+        if (memory_bitmap_initialized == TRUE && order <= MAX_PAGE_ORDER) {
+                u32int index, buddy_index;
+                u32int page_index  = (address - zone->base) / PAGE_SIZE;
+                u32int block_index = page_index >> order;
+                if (block_index < zone->free_blocks[order].size) {
+                        for (index = page_index; index < page_index + (1 << order); index++) {
+                                ASSERT(kbitmap_test(&zone->used_pages, index));
+                                kbitmap_clear(&zone->used_pages, index);
+                                zone->pages[index].refcount = 0;
+                                zone->pages[index].flags    = 0x0;
+                                zone->pages[index].owner    = PAGE_OWNER_NONE;
+                        }
+                        zone->free_pages_count += (1 << order);
+                        //merge with free buddies
+                        while (order < MAX_PAGE_ORDER) {
+                                buddy_index = block_index ^ 0x1;
+                                if (buddy_index >= zone->free_blocks[order].size ||
+                                    kbitmap_test(&zone->free_blocks[order], buddy_index))
+                                        break;
+                                kbitmap_set(&zone->free_blocks[order], buddy_index);
+                                block_index >>= 1;
+                                order++;
+                        }
+                        kbitmap_clear(&zone->free_blocks[order], block_index);
+                        return TRUE;
                 }
         }
 
         return FALSE;
 }
 
+//segment relative addresses may wrap around: pages can live anywhere in physical memory
+void* alloc_code_pages(u32int order)
+{
+    u32int address = (u32int)alloc_pages(&memory_bitmap.zone, order);
+    if (address == NULL)
+        return NULL;
+
+    u32int index;
+    for (index = 0; index < (1 << order); index++) {
+        page_info(address + index * PAGE_SIZE)->flags |= PAGE_CODE;
+    }
+    memory_bitmap.code_pages_used += (1 << order);
+    return (void*)(address - segments_info.code_segment.base);
+}
+
+void* alloc_data_pages(u32int order)
+{
+    u32int address = (u32int)alloc_pages(&memory_bitmap.zone, order);
+    if (address == NULL)
+        return NULL;
+
+    memory_bitmap.data_pages_used += (1 << order);
+    return (void*)(address - segments_info.data_segment.base);
+}
+
+bool free_code_pages(u32int rel_address, u32int order)
+{
+    if (!free_pages(rel_address + segments_info.code_segment.base, order, &memory_bitmap.zone))
+        return FALSE;
+
+    memory_bitmap.code_pages_used -= (1 << order);
+    return TRUE;
+}
+
+bool free_data_pages(u32int rel_address, u32int order)
+{
+    if (!free_pages(rel_address + segments_info.data_segment.base, order, &memory_bitmap.zone))
+        return FALSE;
+
+    memory_bitmap.data_pages_used -= (1 << order);
+    return TRUE;
+}
+
 void* alloc_code_page()
 {
-    return alloc_page(memory_bitmap.code_bitmap);
+    return alloc_code_pages(0);
 }
 
 void* alloc_data_page()
 {
-    return alloc_page(memory_bitmap.data_bitmap);
+    return alloc_data_pages(0);
 }
 
 bool free_code_page(u32int rel_address)
 {
-    return free_page(rel_address, memory_bitmap.code_bitmap);
+    return free_code_pages(rel_address, 0);
 }
 
 bool free_data_page(u32int rel_address)
 {
-    return free_page(rel_address, memory_bitmap.data_bitmap);
+    return free_data_pages(rel_address, 0);
 }
 
-void init_memory_bitmap()
+page_t* page_info(u32int address)
 {
-        u32int bytes, pages;
-        //create code bitmap
-        u32int code_pages_count   =  segments_info.code_segment.len / PAGE_SIZE;
-        bytes                     =  bitmap_in_bytes(code_pages_count);
-        pages                     = (bytes % PAGE_SIZE) ? (bytes / PAGE_SIZE) + 1 : (bytes / PAGE_SIZE);
-        memory_bitmap.code_bitmap = (u8int*)data_top_address;
-        memory_bitmap.code_size   =  code_pages_count;
-        memset(memory_bitmap.code_bitmap, 0x0, PAGE_SIZE);
-        data_top_address         +=  PAGE_SIZE * pages;
-        //create data bitmap
-        u32int data_pages_count   =  segments_info.data_segment.len / PAGE_SIZE;
-        bytes                     =  bitmap_in_bytes(data_pages_count);
-        pages                     = (bytes % PAGE_SIZE) ? (bytes / PAGE_SIZE) + 1 : (bytes / PAGE_SIZE);
-        memory_bitmap.data_bitmap = (u8int*)data_top_address;
-        memory_bitmap.data_size   =  data_pages_count;
-        data_top_address         +=  PAGE_SIZE * pages;
-        memset(memory_bitmap.data_bitmap, 0x0, PAGE_SIZE);
+        page_zone_t *zone  = &memory_bitmap.zone;
+        u32int page_index  = (address - zone->base) / PAGE_SIZE;
+        return (page_index < zone->used_pages.size) ? &zone->pages[page_index] : NULL;
+}
 
-        ASSERT((data_top_address % PAGE_SIZE) == 0);
+void page_ref(u32int address)
+{
+        page_t *page = page_info(address);
+        //saturated counter sticks, such page is never freed by unref
+        if (page != NULL && page->refcount != 0xFFFF)
+                page->refcount++;
+}
+
+void page_unref(u32int address)
+{
+        page_t *page = page_info(address);
+        if (page != NULL && page->refcount != 0xFFFF && page->refcount > 0) {
+                page->refcount--;
+                if (page->refcount == 0 && !(page->flags & PAGE_PINNED)) {
+                        if (page->flags & PAGE_CODE)
+                                free_code_pages(address - segments_info.code_segment.base, 0);
+                        else
+                                free_data_pages(address - segments_info.data_segment.base, 0);
+                }
+        }
+}
+
+static u32int zone_storage_size(u32int pages_count)
+{
+        u32int order, bytes = kbitmap_storage_size(pages_count) + sizeof(page_t) * pages_count;
+        for (order = 0; order <= MAX_PAGE_ORDER; order++) {
+                bytes += kbitmap_storage_size(pages_count >> order);
+        }
 
-        //set used data pages
-        u32int used_data_pages = data_top_address / PAGE_SIZE;
-        u32int index;
-        for (index = 0; index < used_data_pages; index++) {
-                set_bit(memory_bitmap.data_bitmap, index);
+        return bytes;
+}
+
+static void init_zone(page_zone_t *zone, u32int base, u32int pages_count)
+{
+        u32int order, index, bytes, pages;
+        bytes = zone_storage_size(pages_count);
+        pages = (bytes % PAGE_SIZE) ? (bytes / PAGE_SIZE) + 1 : (bytes / PAGE_SIZE);
+        //everything is used until released
+        kbitmap_init(&zone->used_pages, (void*)data_top_address, pages_count, TRUE);
+        u32int storage_address = data_top_address + kbitmap_storage_size(pages_count);
+        for (order = 0; order <= MAX_PAGE_ORDER; order++) {
+                kbitmap_init(&zone->free_blocks[order], (void*)storage_address, pages_count >> order, TRUE);
+                storage_address += kbitmap_storage_size(pages_count >> order);
         }
-        //stack top page
-        set_bit(memory_bitmap.data_bitmap, memory_bitmap.data_size - 1);
+        //pages which are never released (kernel, holes, module image) stay pinned
+        zone->pages = (page_t*)storage_address;
+        for (index = 0; index < pages_count; index++) {
+                zone->pages[index].refcount = 0;
+                zone->pages[index].flags    = PAGE_PINNED;
+                zone->pages[index].owner    = PAGE_OWNER_KERNEL;
+        }
+        zone->base             = base;
+        zone->free_pages_count = 0;
+        data_top_address      += PAGE_SIZE * pages;
+}
 
-        //set used code pages
-        u32int used_code_pages = (u32int)&kernel_code_size / PAGE_SIZE;
-        for (index = 0; index < used_code_pages; index++) {
-                set_bit(memory_bitmap.code_bitmap, index);
+static void release_zone_pages(page_zone_t *zone, u32int first_page, u32int last_page)
+{
+        u32int order;
+        while (first_page < last_page) {
+                //biggest aligned block that fits
+                for (order = MAX_PAGE_ORDER; order > 0; order--) {
+                        if ((first_page % (1 << order)) == 0 && first_page + (1 << order) <= last_page)
+                                break;
+                }
+                free_pages(first_page * PAGE_SIZE, order, zone);
+                first_page += (1 << order);
         }
+}
+
+void init_memory_bitmap()
+{
+        //zone covers physical memory up to the end of the highest region
+        u32int index, top_address = segments_info.code_segment.base + segments_info.code_segment.len;
+        for (index = 0; index < memory_regions_count; index++) {
+                if (memory_regions[index].base + memory_regions[index].len > top_address)
+                        top_address = memory_regions[index].base + memory_regions[index].len;
+        }
+        init_zone(&memory_bitmap.zone, 0x0, top_address / PAGE_SIZE);
 
+        ASSERT((data_top_address % PAGE_SIZE) == 0);
         memory_bitmap_initialized = TRUE;
+
+        //free data pages: from the top of kernel data up to the stack top page
+        //all other pages (code segment too) are released by release_memory_regions() once paging is on
+        u32int data_first_page  = segments_info.data_segment.base / PAGE_SIZE;
+        u32int data_pages_count = segments_info.data_segment.len  / PAGE_SIZE;
+        u32int used_data_pages  = data_top_address / PAGE_SIZE;
+        release_zone_pages(&memory_bitmap.zone, data_first_page + used_data_pages, data_first_page + data_pages_count - 1);
+}
+
+static bool is_segment_page(segment_t *segment, u32int address)
+{
+        return (address >= segment->base && address - segment->base < segment->len) ? TRUE : FALSE;
+}
+
+void release_memory_regions()
+{
+        page_zone_t *zone = &memory_bitmap.zone;
+        segment_t kernel_code = {segments_info.code_segment.base, (u32int)&kernel_code_size};
+        u32int region, page, first_page, last_page;
+        for (region = 0; region < memory_regions_count; region++) {
+                first_page = memory_regions[region].base / PAGE_SIZE;
+                last_page  = first_page + memory_regions[region].len / PAGE_SIZE;
+                //release runs of pages between holes, kernel pages and already released pages
+                for (page = first_page; page < last_page; page++) {
+                        u32int address = page * PAGE_SIZE;
+                        if (page == 0                                               ||
+                            is_segment_page(&segments_info.data_segment,   address) ||
+                            is_segment_page(&kernel_code,                  address) ||
+                            is_segment_page(&segments_info.module_segment, address) ||
+                            !kbitmap_test(&zone->used_pages, page)) {
+                                release_zone_pages(zone, first_page, page);
+                                first_page = page + 1;
+                        }
+                }
+                release_zone_pages(zone, first_page, last_page);
+        }
+}
+
+static void init_memory_regions(u32int memory_map_addr, u32int memory_map_count)
+{
+        //loader put regions right after kernel data, copy them before it is reused
+        segment_t *regions   = (segment_t*)memory_map_addr;
+        memory_regions_count = (memory_map_count > MAX_MEMORY_REGIONS) ? MAX_MEMORY_REGIONS : memory_map_count;
+        memcpy(memory_regions, regions, sizeof(segment_t) * memory_regions_count);
 }
 
 void init_memory_manager(u32int code_base_addr,   u32int code_segment_len,
                          u32int data_base_addr,   u32int data_segment_len,
-                         u32int module_base_addr, u32int module_segment_len)
+                         u32int module_base_addr, u32int module_segment_len,
+                         u32int memory_map_addr,  u32int memory_map_count)
 {
         //segments info
         init_segments_info(code_base_addr, code_segment_len, data_base_addr, data_segment_len, module_base_addr, module_segment_len);
+        //physical memory regions
+        init_memory_regions(memory_map_addr, memory_map_count);
         //memory info
         init_memory_bitmap();
 }
@@ -132,15 +311,17 @@ void print_bitmap_info()
 {
         int i;
         printf("========= used pages:\n");
-        for (i = 0; i < memory_bitmap.data_size; i++) {
-                if (test_bit(memory_bitmap.data_bitmap, i)) {
-                        printf("0x%x\n", i * PAGE_SIZE + segments_info.data_segment.base);
-                }
-        }
-        for (i = 0; i < memory_bitmap.code_size; i++) {
-                if (test_bit(memory_bitmap.code_bitmap, i)) {
-                        printf("0x%x\n", i * PAGE_SIZE + segments_info.code_segment.base );
+        for (i = 0; i < memory_bitmap.zone.used_pages.size; i++) {
+                if (kbitmap_test(&memory_bitmap.zone.used_pages, i)) {
+                        printf("0x%x\n", i * PAGE_SIZE + memory_bitmap.zone.base);
                 }
         }
         printf("=========\n");
 }
+
+void print_memory_info()
+{
+        printf("free pages: %u (%uKB)\n", memory_bitmap.zone.free_pages_count, memory_bitmap.zone.free_pages_count * (PAGE_SIZE / 1024));
+        printf("data pages: %u (%uKB)\n", memory_bitmap.data_pages_used,       memory_bitmap.data_pages_used * (PAGE_SIZE / 1024));
+        printf("code pages: %u (%uKB)",   memory_bitmap.code_pages_used,       memory_bitmap.code_pages_used * (PAGE_SIZE / 1024));
+}
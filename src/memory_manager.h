@@ -2,6 +2,7 @@
 #define MEMORY_MANAGER_H
 
 #include "common.h"
+#include "kbitmap.h"
 
 typedef struct segment_struct {
         u32int base;
@@ -15,22 +16,64 @@ typedef struct segments_info_struct {
         segment_t module_segment;
 } segments_info_t;
 
+#define MAX_PAGE_ORDER     10
+#define MAX_MEMORY_REGIONS 32
+
+//page flags
+#define PAGE_PINNED        0x01
+#define PAGE_ZERO          0x02
+#define PAGE_TABLE         0x04
+#define PAGE_MODULE        0x08
+#define PAGE_HEAP          0x10
+#define PAGE_CODE          0x20
+
+//page owners
+#define PAGE_OWNER_NONE    0x0
+#define PAGE_OWNER_KERNEL  0x1
+#define PAGE_OWNER_MODULE  0x2
+
+//per-frame info: refcount counts mappings, last unref of a not pinned page frees it
+typedef struct page_struct {
+        u16int refcount;
+        u8int  flags;
+        u8int  owner;
+} page_t;
+
+//buddy zone: free_blocks[order] has a clear bit for every free block of 2^order pages
+typedef struct page_zone_struct {
+        u32int    base;
+        kbitmap_t used_pages;
+        kbitmap_t free_blocks[MAX_PAGE_ORDER + 1];
+        page_t   *pages;
+        u32int    free_pages_count;
+} page_zone_t;
+
+//one pool of physical pages shared by code and data mappings
 typedef struct memory_bitmap_struct {
-        u8int  *code_bitmap;
-        u8int  *data_bitmap;
-        u32int  code_size;
-        u32int  data_size;
+        page_zone_t zone;
+        u32int      code_pages_used;
+        u32int      data_pages_used;
 } memory_bitmap_t;
 
 void init_memory_manager(u32int code_base_addr,   u32int code_segment_len,
                          u32int data_base_addr,   u32int data_segment_len,
-                         u32int module_base_addr, u32int module_segment_len);
+                         u32int module_base_addr, u32int module_segment_len,
+                         u32int memory_map_addr,  u32int memory_map_count);
+void release_memory_regions();
 
 void  print_bitmap_info();
+void  print_memory_info();
 void* alloc_data_page();
 bool  free_data_page(u32int rel_address);
 void* alloc_code_page();
 bool  free_code_page(u32int rel_address);
+void* alloc_data_pages(u32int order);
+bool  free_data_pages(u32int rel_address, u32int order);
+void* alloc_code_pages(u32int order);
+bool  free_code_pages(u32int rel_address, u32int order);
+page_t* page_info(u32int address);
+void    page_ref(u32int address);
+void    page_unref(u32int address);
 
 #endif //MEMORY_MANAGER_H
 
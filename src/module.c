@@ -1,6 +1,8 @@
 #include "module.h"
 #include "module_loader.h"
 #include "memory_manager.h"
+#include "kmem_cache.h"
+#include "panic.h"
 
 #define GET_MAGIC(var)            asm("mov %%fs:(0x0),   %%eax":"=a"(var):)
 #define GET_CODE_OFFSET(var)      asm("mov %%fs:(0x4),   %%eax":"=a"(var):)
@@ -12,11 +14,19 @@
 #define MAGIC                 0xDEADBEEF
 
 extern segments_info_t   segments_info;
-module_info_t            module_info;
+module_info_t           *module_info = NULL;
+static kmem_cache_t     *module_cache;
 
+void init_modules()
+{
+        module_cache = kmem_cache_create("module_info", sizeof(module_info_t), 0, NULL);
+        ASSERT(module_cache != NULL);
+}
+
+//the descriptor lives while the module stays loaded
 bool init_module()
 {
-        if(module_info.initialized)
+        if(module_info != NULL && module_info->initialized)
             return TRUE;
 
         u32int magic, code_offset, code_size, data_offset, data_size, entry_point;
@@ -45,13 +55,18 @@ bool init_module()
                     code_size          < free_code_space_size                          &&
                     data_size          < free_data_space_size) {
 
-                        module_info.code_offset = code_offset;
-                        module_info.code_size   = code_size;
-                        module_info.data_offset = data_offset;
-                        module_info.data_size   = data_size;
-                        module_info.entry_point = entry_point;
-                        module_info.running     = FALSE;
-                        module_info.initialized = TRUE;
+                        module_info_t *info = (module_info_t*)kmem_cache_alloc(module_cache);
+                        if (info == NULL)
+                                return FALSE;
+                        memset(info, 0x0, sizeof(module_info_t));
+                        info->code_offset = code_offset;
+                        info->code_size   = code_size;
+                        info->data_offset = data_offset;
+                        info->data_size   = data_size;
+                        info->entry_point = entry_point;
+                        info->running     = FALSE;
+                        info->initialized = TRUE;
+                        module_info       = info;
 
 
                         return TRUE;
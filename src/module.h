@@ -14,6 +14,7 @@ typedef struct module_info_struct {
         u32int  entry_point;
 } module_info_t;
 
+void  init_modules();
 bool  init_module();
 void* alloc_module_data_page();
 bool  free_module_data_page(u32int rel_address);
@@ -6,23 +6,34 @@
 #include "isr.h"
 
 extern segments_info_t   segments_info;
-extern module_info_t     module_info;
+extern module_info_t    *module_info;
 registers_t              kernel_state;
 
+//module image is read through fs
+static bool is_zero_image_page(u32int data_offset, u32int data_size, u32int page)
+{
+        u32int index, value;
+        u32int end = ((page + 1) * PAGE_SIZE > data_size) ? data_size : (page + 1) * PAGE_SIZE;
+        for (index = page * PAGE_SIZE; index < end; index++) {
+                asm("movzbl %%fs:(%1), %0" : "=a"(value) : "b"(data_offset + index));
+                if (value != 0x0)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
 static void load_module_code_and_data(u32int code_offset, u32int code_size, u32int data_offset, u32int data_size)
 {
-        //alloc & mmap code pages
+        //alloc & mmap code pages, they are read-only - kernel writes them with cr0.wp off
         asm ("mov %%ax, %%gs" :: "a"(0x38));
+        set_write_protect(FALSE);
         u32int source_addr, dest_addr;
         u32int code_page_count = (code_size % PAGE_SIZE) ? (code_size / PAGE_SIZE) + 1
                                                          :  code_size / PAGE_SIZE;
         u32int index, virt_rel_addr, phys_rel_addr;
-        for (index = 0; index < code_page_count; index++) {
-                phys_rel_addr      = (u32int)alloc_code_page();
-                virt_rel_addr = MODULE_CODE_LOAD_ADDR + index * PAGE_SIZE;
-                ASSERT(phys_rel_addr != NULL);
-                mmap(segments_info.code_segment, virt_rel_addr, phys_rel_addr, FALSE, TRUE);
-        }
+        bool   mapped = mmap_alloc_range(segments_info.code_segment, alloc_code_pages, MODULE_CODE_LOAD_ADDR, code_page_count, FALSE, TRUE, PAGE_MODULE);
+        ASSERT(mapped);
         //clean code pages
         for (index = MODULE_CODE_LOAD_ADDR; index < (MODULE_CODE_LOAD_ADDR + code_page_count * PAGE_SIZE) - 3; index++) {
                 asm("movb $0x0,  %%al     \n\t"
@@ -35,6 +46,7 @@ static void load_module_code_and_data(u32int code_offset, u32int code_size, u32i
                 asm("movb %%fs:(%0), %%al     \n\t"
                     "movb %%al,      %%gs:(%1) \n\t" :: "b"(source_addr), "d"(dest_addr));
         }
+        set_write_protect(TRUE);
         asm ("mov %%ax, %%gs" :: "a"(0x10));
 
         if (data_size > 0) {
@@ -42,32 +54,41 @@ static void load_module_code_and_data(u32int code_offset, u32int code_size, u32i
                 u32int data_page_count = (data_size % PAGE_SIZE) ? (data_size / PAGE_SIZE) + 1
                                                                  :  data_size / PAGE_SIZE;
 
-                for (index = 0; index < data_page_count; index++) {
-                        phys_rel_addr = (u32int)alloc_data_page();
-                        virt_rel_addr = MODULE_DATA_LOAD_ADDR + index * PAGE_SIZE;
-                        ASSERT(phys_rel_addr != NULL);
-                        mmap(segments_info.data_segment, virt_rel_addr, phys_rel_addr, TRUE, TRUE);
-                        memset((void*)virt_rel_addr, 0x0, PAGE_SIZE);
-                }
-                //copy data
-                for (index = 0; (data_offset + index) < (data_offset + data_size); index++) {
-                        source_addr = data_offset + index;
-                        dest_addr   = MODULE_DATA_LOAD_ADDR + index;
-                        asm("movb %%fs:(%0), %%al     \n\t"
-                            "movb %%al,     %%ds:(%1) \n\t" :: "b"(source_addr), "d"(dest_addr));
+                //runs of all-zero image pages share the zero page until the module writes them
+                u32int run_start, run_end;
+                for (run_start = 0; run_start < data_page_count; run_start = run_end) {
+                        bool zero = is_zero_image_page(data_offset, data_size, run_start);
+                        for (run_end = run_start + 1; run_end < data_page_count && is_zero_image_page(data_offset, data_size, run_end) == zero; run_end++);
+                        virt_rel_addr = MODULE_DATA_LOAD_ADDR + run_start * PAGE_SIZE;
+                        if (zero) {
+                                mapped = mmap_zero_range(virt_rel_addr, run_end - run_start, TRUE);
+                                ASSERT(mapped);
+                                continue;
+                        }
+                        mapped = mmap_alloc_range(segments_info.data_segment, alloc_data_pages, virt_rel_addr, run_end - run_start, TRUE, TRUE, PAGE_MODULE);
+                        ASSERT(mapped);
+                        memset((void*)virt_rel_addr, 0x0, (run_end - run_start) * PAGE_SIZE);
+                        //copy data
+                        for (index = run_start * PAGE_SIZE; index < run_end * PAGE_SIZE && index < data_size; index++) {
+                                source_addr = data_offset + index;
+                                dest_addr   = MODULE_DATA_LOAD_ADDR + index;
+                                asm("movb %%fs:(%0), %%al     \n\t"
+                                    "movb %%al,     %%ds:(%1) \n\t" :: "b"(source_addr), "d"(dest_addr));
+                        }
                 }
         }
         //alloc & mmap stack
         phys_rel_addr = (u32int)alloc_data_page();
         virt_rel_addr = segments_info.data_segment.len - PAGE_SIZE * 2;
         ASSERT(phys_rel_addr != NULL);
-        mmap(segments_info.data_segment, virt_rel_addr, phys_rel_addr, TRUE, TRUE);
+        page_info(phys_rel_addr + segments_info.data_segment.base)->flags |= PAGE_MODULE;
+        mmap(segments_info.data_segment, virt_rel_addr, phys_rel_addr, TRUE, TRUE, cache_write_back);
 }
 
 static void jump_to_module_code(u32int entry_point)
 {
         IRQ_OFF;
-        module_info.running = TRUE;
+        module_info->running = TRUE;
         u32int module_esp = segments_info.data_segment.len - PAGE_SIZE - 1;
         asm volatile(
                 "mov   $0x23,  %%ax  \n\t"
@@ -108,7 +129,7 @@ void save_kernel_state(u32int eip, u32int esp)
 void restore_kernel_state()
 {
         IRQ_OFF;
-        module_info.running = FALSE;
+        module_info->running = FALSE;
         asm ("mov %%eax, %%ds"::"a"(kernel_state.ds));
         asm ("mov %%eax, %%gs"::"a"(kernel_state.ds));
         asm ("mov %%eax, %%fs"::"a"(kernel_state.fs));
@@ -131,16 +152,16 @@ void start_module()
         if (segments_info.module_segment.len > 0) {
                 if (init_module()) {
                         u32int exit_eip, kernel_esp;
-                        if (!module_info.loaded) {
-                                load_module_code_and_data(module_info.code_offset, module_info.code_size, module_info.data_offset, module_info.data_size);
-                                module_info.loaded = TRUE;
+                        if (!module_info->loaded) {
+                                load_module_code_and_data(module_info->code_offset, module_info->code_size, module_info->data_offset, module_info->data_size);
+                                module_info->loaded = TRUE;
                         }
 
                         asm("mov $exit_label, %%eax" :"=a"(exit_eip):);
                         asm("mov %%esp, %%eax"       :"=a"(kernel_esp):);
                         set_kernel_stack_in_tss(kernel_esp);
                         save_kernel_state(exit_eip, kernel_esp);
-                        jump_to_module_code(module_info.entry_point);
+                        jump_to_module_code(module_info->entry_point);
 
                 } else
                         printf("bad module or it doesn't exist...");
@@ -5,18 +5,54 @@
 #include "module_loader.h"
 #include "module.h"
 #include "descriptor_tables.h"
+#include "cpu.h"
+#include "vmalloc.h"
+
+#define IA32_PAT_MSR 0x277
+#define CR4_PSE      0x10
+#define CR4_PGE      0x80
+
+//kernel faults map a window of neighbouring pages, sequential faults double it
+#define FAULT_AROUND_PAGES     4
+#define FAULT_AROUND_MAX_PAGES 64
+
+//pending invlpg's per batch, longer batches end with a full flush
+#define TLB_BATCH_SIZE 32
+
+typedef struct tlb_batch_struct {
+        u32int pending[TLB_BATCH_SIZE];
+        u32int count;
+        u32int depth;
+        bool   full_flush;
+} tlb_batch_t;
 
 extern segments_info_t   segments_info;
 extern u32int            kernel_code_size;
 page_directory_t        *kernel_page_directory;
 u32int                   page_tables_rel_virt_addr;
+bool                     pat_enabled = FALSE;
+bool                     pse_enabled = FALSE;
+bool                     pge_enabled = FALSE;
+static tlb_batch_t       tlb_batch;
+fault_around_t           fault_around = {FAULT_AROUND_PAGES, FAULT_AROUND_PAGES, 0, 0, 0, 0, 0};
+//read-only frame shared by all demand-zero mappings
+u32int                   zero_page_rel_addr;
+zero_pool_t              zero_pool;
+//temporary mapping slot right above the page tables window, shows the zero page when unused
+u32int                   kmap_rel_virt_addr;
+static paging_entry_t   *kmap_entry;
+pt_cache_t               pt_cache;
+//cr0.pg copy for the lookup hot path
+static bool              paging_enabled = FALSE;
 
 static void switch_page_directory(page_directory_t *dir)
 {
+        paging_enabled = TRUE;
         u32int phys_dir_addr = (u32int)dir->page_tables + segments_info.data_segment.base;
         asm volatile("mov %%eax, %%cr3": :"a"(phys_dir_addr));
         asm volatile("mov %cr0, %eax");
-        asm volatile("orl $0x80000000, %eax");
+        //paging + write protect: supervisor writes to read-only pages fault too (copy-on-write)
+        asm volatile("orl $0x80010000, %eax");
         asm volatile("mov %eax, %cr0");
 }
 
@@ -27,67 +63,359 @@ bool is_paging_enabled()
         return (cr0 >> 31);
 }
 
-static void set_pt_entry(paging_entry_t *entry, bool present, bool rw, bool user, u32int address)
+void set_write_protect(bool enabled)
+{
+        if (enabled)
+                asm volatile("mov %%cr0, %%eax      \n\t"
+                             "orl $0x10000, %%eax   \n\t"
+                             "mov %%eax, %%cr0      \n\t" ::: "eax");
+        else
+                asm volatile("mov %%cr0, %%eax      \n\t"
+                             "andl $0xFFFEFFFF, %%eax \n\t"
+                             "mov %%eax, %%cr0      \n\t" ::: "eax");
+}
+
+static void init_pat()
+{
+        if (cpu_has(CPU_FEATURE_PAT)) {
+                //PA0-PA3 keep power-on WB, WT, UC-, UC; PA5 (PAT=1, PCD=0, PWT=1) becomes WC
+                asm volatile("wrmsr" :: "c"(IA32_PAT_MSR), "a"(0x00070406), "d"(0x00070106));
+                pat_enabled = TRUE;
+        }
+}
+
+static void set_cr4_bits(u32int bits)
+{
+        asm volatile("mov %%cr4, %%eax   \n\t"
+                     "orl %0,    %%eax   \n\t"
+                     "mov %%eax, %%cr4   \n\t" :: "r"(bits) : "eax");
+}
+
+static void init_pse()
+{
+        if (cpu_has(CPU_FEATURE_PSE)) {
+                set_cr4_bits(CR4_PSE);
+                pse_enabled = TRUE;
+        }
+}
+
+//kernel mappings survive cr3 reloads
+static void init_pge()
+{
+        if (cpu_has(CPU_FEATURE_PGE)) {
+                set_cr4_bits(CR4_PGE);
+                pge_enabled = TRUE;
+        }
+}
+
+//invlpg operand is data segment relative
+static void invalidate_page(u32int virt_lin_address)
 {
+        asm volatile("invlpg (%0)" :: "r"(virt_lin_address - segments_info.data_segment.base) : "memory");
+}
+
+//cr3 reload keeps global entries, toggling cr4.pge drops them too
+static void flush_tlb_all()
+{
+        if (pge_enabled) {
+                asm volatile("mov %%cr4, %%eax   \n\t"
+                             "xorl %0,   %%eax   \n\t"
+                             "mov %%eax, %%cr4   \n\t"
+                             "xorl %0,   %%eax   \n\t"
+                             "mov %%eax, %%cr4   \n\t" :: "r"(CR4_PGE) : "eax", "memory");
+        } else {
+                asm volatile("mov %%cr3, %%eax   \n\t"
+                             "mov %%eax, %%cr3   \n\t" ::: "eax", "memory");
+        }
+}
+
+void tlb_begin_batch()
+{
+        tlb_batch.depth++;
+}
+
+void tlb_end_batch()
+{
+        u32int index;
+        ASSERT(tlb_batch.depth > 0);
+        if (--tlb_batch.depth > 0)
+                return;
+        if (tlb_batch.full_flush) {
+                flush_tlb_all();
+        } else {
+                for (index = 0; index < tlb_batch.count; index++) {
+                        invalidate_page(tlb_batch.pending[index]);
+                }
+        }
+        tlb_batch.count      = 0;
+        tlb_batch.full_flush = FALSE;
+}
+
+//invalidate now or queue until the outermost batch ends
+static void tlb_invalidate(u32int virt_lin_address)
+{
+        if (!paging_enabled)
+                return;
+        if (tlb_batch.depth == 0) {
+                invalidate_page(virt_lin_address);
+        } else if (tlb_batch.count < TLB_BATCH_SIZE) {
+                tlb_batch.pending[tlb_batch.count++] = virt_lin_address;
+        } else {
+                tlb_batch.full_flush = TRUE;
+        }
+}
+
+//directory entries are always write-back: their size bit is not the PAT bit
+static void set_pt_entry(paging_entry_t *entry, bool present, bool rw, bool user, cache_policy_t cache, u32int address)
+{
+        if (cache == cache_write_combining && !pat_enabled)
+                cache = cache_uncached;
         entry->present        =  present;
         entry->rw             =  rw;
         entry->user           =  user;
-        entry->write_through  =  0x1;
-        entry->cache_disabled =  0x1;
+        entry->write_through  = (cache != cache_write_back);
+        entry->cache_disabled = (cache == cache_uncached);
         entry->accessed       =  0x0;
         entry->dirty          =  0x0;
-        entry->size           =  0x0;
-        entry->global         =  0x0;
+        entry->size           = (cache == cache_write_combining);
+        entry->global         = (pge_enabled && !user);
+        entry->cow            =  0x0;
         entry->unused         =  0x0;
         entry->address        = (address >> 12);
 }
 
+static void* kmap(u32int phys_lin_address)
+{
+        set_pt_entry(kmap_entry, TRUE, TRUE, FALSE, cache_write_back, phys_lin_address);
+        invalidate_page(kmap_rel_virt_addr + segments_info.data_segment.base);
+        return (void*)kmap_rel_virt_addr;
+}
+
+static void kunmap()
+{
+        set_pt_entry(kmap_entry, TRUE, FALSE, FALSE, cache_write_back, zero_page_rel_addr + segments_info.data_segment.base);
+        invalidate_page(kmap_rel_virt_addr + segments_info.data_segment.base);
+}
+
+//unmapped frame is zeroed through the kmap slot, before paging it is reachable directly
+static void zero_frame(u32int rel_phys_address)
+{
+        if (!paging_enabled) {
+                memset((void*)rel_phys_address, 0x0, PAGE_SIZE);
+                return;
+        }
+        u32int eflags = irq_save();
+        memset(kmap(rel_phys_address + segments_info.data_segment.base), 0x0, PAGE_SIZE);
+        kunmap();
+        irq_restore(eflags);
+}
+
+//data segment relative address of a zeroed frame, pre-zeroed pool first
+void* alloc_zeroed_data_page()
+{
+        u32int address = NULL;
+        u32int eflags  = irq_save();
+        if (zero_pool.count > 0) {
+                address = zero_pool.pages[--zero_pool.count];
+                zero_pool.hits++;
+        } else
+                zero_pool.misses++;
+        irq_restore(eflags);
+
+        if (address != NULL) {
+                page_info(address + segments_info.data_segment.base)->flags &= ~PAGE_ZERO;
+        } else {
+                address = (u32int)alloc_data_page();
+                if (address != NULL)
+                        zero_frame(address);
+        }
+
+        return (void*)address;
+}
+
+//idle time work: zero one more pool page, FALSE when there is nothing to do
+bool refill_zero_pool()
+{
+        if (zero_pool.count >= ZERO_POOL_SIZE || kmap_entry == NULL)
+                return FALSE;
+        u32int address = (u32int)alloc_data_page();
+        if (address == NULL)
+                return FALSE;
+        zero_frame(address);
+        page_info(address + segments_info.data_segment.base)->flags |= PAGE_ZERO;
+        u32int eflags = irq_save();
+        zero_pool.pages[zero_pool.count++] = address;
+        irq_restore(eflags);
+
+        return TRUE;
+}
+
+//directory maps itself at page_tables_rel_virt_addr: page table i is the i-th page there
+static page_table_t* page_table_ptr(page_directory_t *dir, u32int page_table_index)
+{
+        return (paging_enabled) ? (page_table_t*)(page_tables_rel_virt_addr + page_table_index * PAGE_SIZE)
+                                : (page_table_t*)(dir->page_tables[page_table_index].address * PAGE_SIZE - segments_info.data_segment.base);
+}
+
+//bulk refill: one buddy block, frames are cleared before they go to the cache
+static void pt_cache_refill(u32int wanted)
+{
+        u32int index, address, order;
+        wanted = (wanted > PT_CACHE_SIZE) ? PT_CACHE_SIZE : wanted;
+        while (pt_cache.count < wanted) {
+                for (order = 0; (2 << order) <= PT_CACHE_SIZE - pt_cache.count && (2 << order) <= PT_CACHE_REFILL; order++);
+                address = (u32int)alloc_data_pages(order);
+                if (address == NULL && (address = (u32int)alloc_data_page()) != NULL)
+                        order = 0;
+                if (address == NULL)
+                        return;
+                for (index = 0; index < (1 << order); index++) {
+                        zero_frame(address + index * PAGE_SIZE);
+                        page_info(address + index * PAGE_SIZE + segments_info.data_segment.base)->flags |= PAGE_PINNED;
+                        pt_cache.frames[pt_cache.count++] = address + index * PAGE_SIZE;
+                }
+        }
+}
+
+//frames that already were page tables keep PAGE_TABLE in the cache
+static u32int alloc_page_table_frame()
+{
+        if (pt_cache.count == 0)
+                pt_cache_refill(PT_CACHE_REFILL);
+        ASSERT(pt_cache.count > 0);
+        u32int address = pt_cache.frames[--pt_cache.count];
+        page_t *page   = page_info(address + segments_info.data_segment.base);
+        if (page->flags & PAGE_TABLE)
+                pt_cache.reused++;
+        else
+                pt_cache.allocated++;
+        page->flags   |= PAGE_TABLE | PAGE_PINNED;
+        page->refcount = 0;
+
+        return address;
+}
+
+static void free_page_table_frame(u32int address)
+{
+        if (pt_cache.count < PT_CACHE_SIZE) {
+                pt_cache.frames[pt_cache.count++] = address;
+        } else {
+                page_info(address + segments_info.data_segment.base)->flags &= ~PAGE_PINNED;
+                free_data_page(address);
+        }
+        pt_cache.freed++;
+}
+
+//cached frames are clean, a split table is filled before the directory entry points to it
+static void install_page_table(page_directory_t *dir, u32int page_table_index, paging_entry_t *large_pd_entry)
+{
+        u32int index, eflags;
+        u32int pt_rel_addr   = alloc_page_table_frame();
+        page_table_t  *pt    = (page_table_t*)pt_rel_addr;
+        cache_policy_t cache;
+        if (large_pd_entry != NULL) {
+                if (paging_enabled) {
+                        eflags = irq_save();
+                        pt     = kmap(pt_rel_addr + segments_info.data_segment.base);
+                }
+                cache = (large_pd_entry->cache_disabled) ? cache_uncached
+                      : (large_pd_entry->write_through)  ? cache_write_through : cache_write_back;
+                for (index = 0; index < 1024; index++) {
+                        set_pt_entry(&pt->pages[index], TRUE, large_pd_entry->rw, large_pd_entry->user, cache,
+                                     large_pd_entry->address * PAGE_SIZE + index * PAGE_SIZE);
+                }
+                if (paging_enabled) {
+                        kunmap();
+                        irq_restore(eflags);
+                }
+                //table frame refcount is the count of present entries
+                page_info(pt_rel_addr + segments_info.data_segment.base)->refcount = 1024;
+        }
+        set_pt_entry(&dir->page_tables[page_table_index], TRUE, TRUE, TRUE, cache_write_back, pt_rel_addr + segments_info.data_segment.base);
+        //window slot of this table and the old 4 MiB translation
+        if (paging_enabled) {
+                invalidate_page(page_tables_rel_virt_addr + page_table_index * PAGE_SIZE + segments_info.data_segment.base);
+                if (large_pd_entry != NULL)
+                        tlb_invalidate(page_table_index * LARGE_PAGE_SIZE);
+        }
+}
+
+//table without present entries goes back to the cache, the window and the table itself are never reclaimed
+static void reclaim_page_table(u32int virt_lin_address)
+{
+        u32int page_table_index  = virt_lin_address / LARGE_PAGE_SIZE;
+        paging_entry_t *pd_entry = &kernel_page_directory->page_tables[page_table_index];
+        if (!paging_enabled || !pd_entry->present || pd_entry->size ||
+            page_table_index == (page_tables_rel_virt_addr + segments_info.data_segment.base) / LARGE_PAGE_SIZE)
+                return;
+        u32int pt_lin_addr = pd_entry->address * PAGE_SIZE;
+        if (page_info(pt_lin_addr)->refcount != 0)
+                return;
+        *(u32int*)pd_entry = 0x0;
+        invalidate_page(page_tables_rel_virt_addr + page_table_index * PAGE_SIZE + segments_info.data_segment.base);
+        invalidate_page(page_table_index * LARGE_PAGE_SIZE);
+        free_page_table_frame(pt_lin_addr - segments_info.data_segment.base);
+}
+
 static paging_entry_t* get_pt_entry(u32int virt_lin_address, page_directory_t *dir, bool make_page_table)
 {
-        u32int phys_pt_address;
-        paging_entry_t *pt_entry = NULL;
         u32int page_number       = virt_lin_address / PAGE_SIZE;
         u32int page_table_index  = page_number      / 1024;
         u32int page_index        = page_number      % 1024;
+        paging_entry_t *pd_entry = &dir->page_tables[page_table_index];
 
-        if (dir->page_table_ptrs[page_table_index] != NULL) {
-                pt_entry = (is_paging_enabled())? &dir->page_table_ptrs[page_table_index]->pages[page_index]
-                                                : &((page_table_t*)(dir->page_tables[page_table_index].address * PAGE_SIZE - segments_info.data_segment.base))->pages[page_index];
-                return pt_entry;
-
-        } else if (make_page_table == TRUE) {
-                page_table_t *pt = (page_table_t*)alloc_data_page();
-                u32int pt_phys_addr = segments_info.data_segment.base + (u32int)pt;
-                //set ppt entry
-                u32int ptt_index = (page_tables_rel_virt_addr + segments_info.data_segment.base) / (PAGE_SIZE * 1024);
-                page_table_t *ptt = (is_paging_enabled())? dir->page_table_ptrs[ptt_index]
-                                                         : (page_table_t*)(dir->page_tables[ptt_index].address * PAGE_SIZE - segments_info.data_segment.base);
-                paging_entry_t *ptt_entry = &ptt->pages[page_table_index];
-                set_pt_entry(ptt_entry, TRUE, TRUE, FALSE, pt_phys_addr);
-                //set dir entry
-                dir->page_table_ptrs[page_table_index] = (page_table_t*)(page_tables_rel_virt_addr + page_table_index * PAGE_SIZE);
-                paging_entry_t *pd_entry = &dir->page_tables[page_table_index];
-                set_pt_entry(pd_entry, TRUE, TRUE, TRUE, pt_phys_addr);
-                //return value & clean new page table
-                if (is_paging_enabled()) {
-                        pt_entry = &dir->page_table_ptrs[page_table_index]->pages[page_index];
-                        memset(dir->page_table_ptrs[page_table_index], 0x0, sizeof(page_table_t));
-                } else {
-                        pt_entry = &pt->pages[page_index];
-                        memset(pt, 0x0, sizeof(page_table_t));
-                }
+        if (!pd_entry->present) {
+                if (make_page_table == FALSE)
+                        return NULL;
+                install_page_table(dir, page_table_index, NULL);
+        } else if (pd_entry->size) {
+                //replace 4 MiB page by page table with the same mappings
+                paging_entry_t large_pd_entry = *pd_entry;
+                install_page_table(dir, page_table_index, &large_pd_entry);
         }
 
-        return pt_entry;
+        return &page_table_ptr(dir, page_table_index)->pages[page_index];
+}
+
+static void map_pt_entry(paging_entry_t *pt_entry, u32int virt_lin_address, u32int phys_lin_address, bool rw, bool user, cache_policy_t cache)
+{
+        //take the new reference before dropping the old one - remapping the same frame must not free it
+        bool   present          = pt_entry->present;
+        page_ref(phys_lin_address);
+        if (present)
+                page_unref(pt_entry->address * PAGE_SIZE);
+        else
+                page_ref(kernel_page_directory->page_tables[virt_lin_address / LARGE_PAGE_SIZE].address * PAGE_SIZE);
+        set_pt_entry(pt_entry, TRUE, rw, user, cache, phys_lin_address);
+        //not present entries are never cached
+        if (present)
+                tlb_invalidate(virt_lin_address);
+        page_t *page = page_info(phys_lin_address);
+        if (page != NULL && page->owner == PAGE_OWNER_NONE)
+                page->owner = (user) ? PAGE_OWNER_MODULE : PAGE_OWNER_KERNEL;
+}
+
+static void unmap_pt_entry(paging_entry_t *pt_entry, u32int virt_lin_address)
+{
+        bool   present          = pt_entry->present;
+        u32int phys_lin_address = pt_entry->address * PAGE_SIZE;
+        //empty entries stay all zero: reclaimed tables are clean
+        *(u32int*)pt_entry = 0x0;
+        if (present) {
+                tlb_invalidate(virt_lin_address);
+                //last mapping gone - frame goes back to memory manager
+                page_unref(phys_lin_address);
+                page_unref(kernel_page_directory->page_tables[virt_lin_address / LARGE_PAGE_SIZE].address * PAGE_SIZE);
+        }
 }
 
-bool mmap(segment_t segment, u32int virt_rel_address, u32int phys_rel_address, bool rw, bool user)
+bool mmap(segment_t segment, u32int virt_rel_address, u32int phys_rel_address, bool rw, bool user, cache_policy_t cache)
 {
         u32int virt_lin_address  = virt_rel_address + segment.base;
         u32int phys_lin_address  = phys_rel_address + segment.base;
         paging_entry_t *pt_entry = get_pt_entry(virt_lin_address, kernel_page_directory, TRUE);
         if (pt_entry != NULL) {
-                set_pt_entry(pt_entry, TRUE, rw, user, phys_lin_address);
+                map_pt_entry(pt_entry, virt_lin_address, phys_lin_address, rw, user, cache);
                 return TRUE;
         }
 
@@ -99,17 +427,282 @@ bool munmap(segment_t segment, u32int virt_rel_address)
         u32int virt_lin_address  = virt_rel_address + segment.base;
         paging_entry_t *pt_entry = get_pt_entry(virt_lin_address, kernel_page_directory, FALSE);
         if (pt_entry != NULL) {
-                set_pt_entry(pt_entry, FALSE, FALSE, FALSE, 0x0);
+                unmap_pt_entry(pt_entry, virt_lin_address);
+                reclaim_page_table(virt_lin_address);
                 return TRUE;
         }
 
         return FALSE;
 }
 
+static void map_large_page(u32int virt_lin_address, u32int phys_lin_address, bool rw, bool user, cache_policy_t cache)
+{
+        u32int index;
+        paging_entry_t *pd_entry = &kernel_page_directory->page_tables[virt_lin_address / LARGE_PAGE_SIZE];
+        for (index = 0; index < 1024; index++) {
+                page_ref(phys_lin_address + index * PAGE_SIZE);
+                page_t *page = page_info(phys_lin_address + index * PAGE_SIZE);
+                if (page != NULL && page->owner == PAGE_OWNER_NONE)
+                        page->owner = (user) ? PAGE_OWNER_MODULE : PAGE_OWNER_KERNEL;
+        }
+        bool present = pd_entry->present;
+        if (present) {
+                for (index = 0; index < 1024; index++) {
+                        page_unref(pd_entry->address * PAGE_SIZE + index * PAGE_SIZE);
+                }
+        }
+        set_pt_entry(pd_entry, TRUE, rw, user, cache, phys_lin_address);
+        pd_entry->size = 0x1;
+        if (present)
+                tlb_invalidate(virt_lin_address);
+}
+
+static bool can_map_large_page(u32int virt_lin_address, u32int phys_lin_address, u32int pages_count, cache_policy_t cache)
+{
+        return pse_enabled && cache != cache_write_combining  &&
+               (virt_lin_address % LARGE_PAGE_SIZE) == 0       &&
+               (phys_lin_address % LARGE_PAGE_SIZE) == 0       &&
+               pages_count >= 1024                             &&
+               !(kernel_page_directory->page_tables[virt_lin_address / LARGE_PAGE_SIZE].present &&
+                 !kernel_page_directory->page_tables[virt_lin_address / LARGE_PAGE_SIZE].size);
+}
+
+//cache gets every page table the range is missing in one refill
+static void reserve_page_tables(u32int virt_lin_address, u32int phys_lin_address, u32int pages_count, cache_policy_t cache)
+{
+        u32int count, missing = 0;
+        while (pages_count > 0) {
+                count = 1024 - (virt_lin_address / PAGE_SIZE) % 1024;
+                count = (count > pages_count) ? pages_count : count;
+                paging_entry_t *pd_entry = &kernel_page_directory->page_tables[virt_lin_address / LARGE_PAGE_SIZE];
+                if ((!pd_entry->present || pd_entry->size) &&
+                    !can_map_large_page(virt_lin_address, phys_lin_address, pages_count, cache))
+                        missing++;
+                virt_lin_address += count * PAGE_SIZE;
+                phys_lin_address += count * PAGE_SIZE;
+                pages_count      -= count;
+        }
+        pt_cache_refill(missing);
+}
+
+//page tables are resolved once per 4 MiB, 4 MiB pages are used for spans where both addresses are aligned
+bool mmap_range(segment_t segment, u32int virt_rel_address, u32int phys_rel_address, u32int pages_count, bool rw, bool user, cache_policy_t cache)
+{
+        u32int index, count;
+        u32int virt_lin_address = virt_rel_address + segment.base;
+        u32int phys_lin_address = phys_rel_address + segment.base;
+        bool   result           = TRUE;
+        tlb_begin_batch();
+        reserve_page_tables(virt_lin_address, phys_lin_address, pages_count, cache);
+        while (pages_count > 0) {
+                if (can_map_large_page(virt_lin_address, phys_lin_address, pages_count, cache)) {
+                        map_large_page(virt_lin_address, phys_lin_address, rw, user, cache);
+                        count = 1024;
+                } else {
+                        count = 1024 - (virt_lin_address / PAGE_SIZE) % 1024;
+                        count = (count > pages_count) ? pages_count : count;
+                        paging_entry_t *pt_entry = get_pt_entry(virt_lin_address, kernel_page_directory, TRUE);
+                        if (pt_entry == NULL) {
+                                result = FALSE;
+                                break;
+                        }
+                        for (index = 0; index < count; index++) {
+                                map_pt_entry(&pt_entry[index], virt_lin_address + index * PAGE_SIZE, phys_lin_address + index * PAGE_SIZE, rw, user, cache);
+                        }
+                }
+                virt_lin_address += count * PAGE_SIZE;
+                phys_lin_address += count * PAGE_SIZE;
+                pages_count      -= count;
+        }
+        tlb_end_batch();
+
+        return result;
+}
+
+//unmapped pages are flushed once, past TLB_BATCH_SIZE the whole tlb is dropped
+bool munmap_range(segment_t segment, u32int virt_rel_address, u32int pages_count)
+{
+        u32int index, count;
+        u32int virt_lin_address = virt_rel_address + segment.base;
+        bool   result           = TRUE;
+        tlb_begin_batch();
+        while (pages_count > 0) {
+                count = 1024 - (virt_lin_address / PAGE_SIZE) % 1024;
+                count = (count > pages_count) ? pages_count : count;
+                paging_entry_t *pt_entry = get_pt_entry(virt_lin_address, kernel_page_directory, FALSE);
+                if (pt_entry != NULL) {
+                        for (index = 0; index < count; index++) {
+                                unmap_pt_entry(&pt_entry[index], virt_lin_address + index * PAGE_SIZE);
+                        }
+                        reclaim_page_table(virt_lin_address);
+                } else
+                        result = FALSE;
+                virt_lin_address += count * PAGE_SIZE;
+                pages_count      -= count;
+        }
+        tlb_end_batch();
+
+        return result;
+}
+
+//demand-zero data pages: shared zero frame mapped read-only, private frame on first write
+bool mmap_zero_range(u32int virt_rel_address, u32int pages_count, bool user)
+{
+        u32int index, count;
+        u32int virt_lin_address = virt_rel_address + segments_info.data_segment.base;
+        u32int zero_lin_address = zero_page_rel_addr + segments_info.data_segment.base;
+        bool   result           = TRUE;
+        tlb_begin_batch();
+        while (pages_count > 0) {
+                count = 1024 - (virt_lin_address / PAGE_SIZE) % 1024;
+                count = (count > pages_count) ? pages_count : count;
+                paging_entry_t *pt_entry = get_pt_entry(virt_lin_address, kernel_page_directory, TRUE);
+                if (pt_entry == NULL) {
+                        result = FALSE;
+                        break;
+                }
+                for (index = 0; index < count; index++) {
+                        map_pt_entry(&pt_entry[index], virt_lin_address + index * PAGE_SIZE, zero_lin_address, FALSE, user, cache_write_back);
+                        pt_entry[index].cow = 0x1;
+                }
+                virt_lin_address += count * PAGE_SIZE;
+                pages_count      -= count;
+        }
+        tlb_end_batch();
+
+        return result;
+}
+
+//moves present entries to the new range with their frames, nothing is copied or freed
+void mremap_range(u32int old_virt_rel_address, u32int new_virt_rel_address, u32int pages_count)
+{
+        u32int index;
+        u32int old_lin_address = old_virt_rel_address + segments_info.data_segment.base;
+        u32int new_lin_address = new_virt_rel_address + segments_info.data_segment.base;
+        tlb_begin_batch();
+        for (index = 0; index < pages_count; index++, old_lin_address += PAGE_SIZE, new_lin_address += PAGE_SIZE) {
+                paging_entry_t *old_entry = get_pt_entry(old_lin_address, kernel_page_directory, FALSE);
+                if (old_entry == NULL || !old_entry->present)
+                        continue;
+                paging_entry_t *new_entry = get_pt_entry(new_lin_address, kernel_page_directory, TRUE);
+                ASSERT(!new_entry->present);
+                *new_entry = *old_entry;
+                page_ref(kernel_page_directory->page_tables[new_lin_address / LARGE_PAGE_SIZE].address * PAGE_SIZE);
+                *(u32int*)old_entry = 0x0;
+                tlb_invalidate(old_lin_address);
+                page_unref(kernel_page_directory->page_tables[old_lin_address / LARGE_PAGE_SIZE].address * PAGE_SIZE);
+                reclaim_page_table(old_lin_address);
+        }
+        tlb_end_batch();
+}
+
+//frames come in the biggest buddy blocks available so every block is mapped by one mmap_range
+bool mmap_alloc_range(segment_t segment, void* (*alloc)(u32int order), u32int virt_rel_address, u32int pages_count, bool rw, bool user, u8int page_flags)
+{
+        u32int index, address, order = MAX_PAGE_ORDER;
+        bool   result = TRUE;
+        tlb_begin_batch();
+        while (pages_count > 0) {
+                while ((1 << order) > pages_count)
+                        order--;
+                address = (u32int)alloc(order);
+                if (address == NULL) {
+                        if (order == 0) {
+                                result = FALSE;
+                                break;
+                        }
+                        order--;
+                        continue;
+                }
+                for (index = 0; index < (1 << order); index++) {
+                        page_info(address + index * PAGE_SIZE + segment.base)->flags |= page_flags;
+                }
+                mmap_range(segment, virt_rel_address, address, 1 << order, rw, user, cache_write_back);
+                virt_rel_address += PAGE_SIZE << order;
+                pages_count      -= 1 << order;
+        }
+        tlb_end_batch();
+
+        return result;
+}
+
+//map zeroed pages from the faulting one up to the first present entry, the window end, the end of
+//the range it belongs to or the page table end. Descending access maps the window downward
+static void fault_around_page(u32int rel_virt_faulting_address, u32int range_start, u32int range_end)
+{
+        u32int index, count;
+        u32int fault_page = rel_virt_faulting_address / PAGE_SIZE;
+        u32int rel_page_address = fault_page * PAGE_SIZE;
+        //sequential access - next fault lands right after the previous window, or right below it for stacks
+        bool   ascending  = fault_around.faults > 0 && fault_page == fault_around.next_page;
+        bool   descending = fault_around.faults > 0 && fault_page + 1 == fault_around.first_page;
+        if (ascending || descending)
+                fault_around.window = (fault_around.window * 2 > FAULT_AROUND_MAX_PAGES) ? FAULT_AROUND_MAX_PAGES : fault_around.window * 2;
+        else
+                fault_around.window = fault_around.base_pages;
+
+        paging_entry_t *pt_entry = get_pt_entry(rel_page_address + segments_info.data_segment.base, kernel_page_directory, TRUE);
+        ASSERT(pt_entry != NULL);
+        if (descending) {
+                count = fault_page % 1024 + 1;
+                count = (count > fault_around.window) ? fault_around.window : count;
+                count = (count > fault_page - range_start / PAGE_SIZE + 1) ? fault_page - range_start / PAGE_SIZE + 1 : count;
+                for (index = 1; index < count && !pt_entry[-(s32int)index].present; index++);
+                count             = index;
+                fault_page       -= count - 1;
+                rel_page_address  = fault_page * PAGE_SIZE;
+                pt_entry         -= count - 1;
+        } else {
+                count = 1024 - fault_page % 1024;
+                count = (count > fault_around.window) ? fault_around.window : count;
+                count = (count > (range_end - rel_page_address) / PAGE_SIZE) ? (range_end - rel_page_address) / PAGE_SIZE : count;
+                for (index = 1; index < count && !pt_entry[index].present; index++);
+                count = index;
+        }
+
+        for (index = 0; index < count; index++) {
+                u32int rel_phys_alloced_address = (u32int)alloc_zeroed_data_page();
+                if (rel_phys_alloced_address == NULL)
+                    PANIC("No free memory...");
+                map_pt_entry(&pt_entry[index], rel_page_address + segments_info.data_segment.base + index * PAGE_SIZE,
+                             rel_phys_alloced_address + segments_info.data_segment.base, TRUE, FALSE, cache_write_back);
+        }
+        fault_around.faults++;
+        fault_around.pages_mapped += count;
+        fault_around.first_page    = fault_page;
+        fault_around.next_page     = fault_page + count;
+}
+
+//write to a shared zero page - replace it by a private zeroed frame
+static bool cow_fault(u32int faulting_address)
+{
+        if (faulting_address <  segments_info.data_segment.base ||
+            faulting_address >= segments_info.data_segment.base + segments_info.data_segment.len)
+                return FALSE;
+        paging_entry_t *pt_entry = get_pt_entry(faulting_address, kernel_page_directory, FALSE);
+        if (pt_entry == NULL || !pt_entry->present || !pt_entry->cow)
+                return FALSE;
+
+        bool   user                     = pt_entry->user;
+        u32int rel_page_address         = (faulting_address - segments_info.data_segment.base) & 0xFFFFF000;
+        u32int rel_phys_alloced_address = (u32int)alloc_zeroed_data_page();
+        if (rel_phys_alloced_address == NULL)
+            PANIC("No free memory...");
+        if (user)
+                page_info(rel_phys_alloced_address + segments_info.data_segment.base)->flags |= PAGE_MODULE;
+        mmap(segments_info.data_segment, rel_page_address, rel_phys_alloced_address, TRUE, user, cache_write_back);
+        fault_around.cow_faults++;
+
+        return TRUE;
+}
+
 static void page_fault_handler(registers_t *regs)
 {
         u32int faulting_address;
         asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
+        //protection fault on write - copy-on-write page, kernel or module
+        if ((regs->err_code & 0x3) == 0x3 && cow_fault(faulting_address))
+                return;
         u32int present  = !(regs->err_code & 0x1) ? 1 : 0;
         u32int rw       =   regs->err_code & 0x2  ? 1 : 0;
         u32int user     =   regs->err_code & 0x4  ? 1 : 0;
@@ -150,11 +743,28 @@ static void page_fault_handler(registers_t *regs)
         if (user)
             exit_module();
         ASSERT(faulting_address < segments_info.code_segment.base);
-        u32int rel_virt_faulting_address = faulting_address - segments_info.data_segment.base;
-        u32int rel_phys_alloced_address  = (u32int)alloc_data_page();
-        if (rel_phys_alloced_address == NULL)
-            PANIC("No free memory...");
-        mmap(segments_info.data_segment, rel_virt_faulting_address, rel_phys_alloced_address, TRUE, FALSE);
+        u32int range_start, range_end;
+        if (!vm_fault_range(faulting_address - segments_info.data_segment.base, &range_start, &range_end))
+                PANIC("page fault on a vmalloc guard page or free range");
+        fault_around_page(faulting_address - segments_info.data_segment.base, range_start, range_end);
+}
+
+void set_fault_around_pages(u32int pages_count)
+{
+        pages_count = (pages_count == 0)                      ? 1
+                    : (pages_count > FAULT_AROUND_MAX_PAGES)  ? FAULT_AROUND_MAX_PAGES : pages_count;
+        fault_around.base_pages = pages_count;
+        fault_around.window     = pages_count;
+}
+
+void print_fault_info()
+{
+        printf("page faults: %u, pages mapped: %u, traps saved: %u\n", fault_around.faults, fault_around.pages_mapped,
+                                                                       fault_around.pages_mapped - fault_around.faults);
+        printf("fault-around window: %u (base %u)\n", fault_around.window, fault_around.base_pages);
+        printf("copy-on-write faults: %u\n", fault_around.cow_faults);
+        printf("zero pool: %u/%u pages, hits: %u, misses: %u\n", zero_pool.count, ZERO_POOL_SIZE, zero_pool.hits, zero_pool.misses);
+        printf("page tables: allocated: %u, reused: %u, freed: %u, cached: %u", pt_cache.allocated, pt_cache.reused, pt_cache.freed, pt_cache.count);
 }
 
 void print_page_info()
@@ -169,12 +779,13 @@ void print_page_info()
         for(i = 0; i < 1024; i++) {
                 paging_entry_t pd_e = kernel_page_directory->page_tables[i];
                 u32int value = *((u32int*)&pd_e);
-                u32int pt_addr = (is_paging_enabled())? (u32int)kernel_page_directory->page_table_ptrs[i]
-                                                      : value & 0xFFFFF000;
-                if (pt_addr != NULL) {
-                        //printf("kernel_page_directory[%u]=%x(table phys addr=0x%x;range=[%uMB,%uMB])\n", i, value, pt_addr, i*4, i*4 + 4);
-                        page_table_t *table = (is_paging_enabled())? (page_table_t*)pt_addr
-                                                                   : (page_table_t*)(pt_addr - db);
+                if (pd_e.present && pd_e.size) {
+                        printf("i = %x, 4MB : %x -> %x\n", i, 4 * 1024 * 1024 * i, value & 0xFFC00000);
+                        continue;
+                }
+                if (pd_e.present) {
+                        //printf("kernel_page_directory[%u]=%x(table phys addr=0x%x;range=[%uMB,%uMB])\n", i, value, value & 0xFFFFF000, i*4, i*4 + 4);
+                        page_table_t *table = page_table_ptr(kernel_page_directory, i);
                         for(j=0; j<1024; j++) {
                                 paging_entry_t pt_e = table->pages[j];
                                 value = *((u32int*)&pt_e);
@@ -194,11 +805,10 @@ void print_page_info()
 
 static void init_paging_tables()
 {
-        //init kernel page directory + table of mapping page tables
-        //dirty hack with allocation pages
-        //sizeof dir is 2 pages!
+        //init kernel page directory, it maps itself as the table of page tables
         kernel_page_directory =  (page_directory_t*)alloc_data_page();
-        alloc_data_page();
+        ASSERT(kernel_page_directory != NULL);
+        page_info((u32int)kernel_page_directory + segments_info.data_segment.base)->flags |= PAGE_TABLE | PAGE_PINNED;
         memset(kernel_page_directory, 0x0, sizeof(page_directory_t));
 
         u32int top_data_phys_address   = ((u32int)kernel_page_directory + sizeof(page_directory_t) + segments_info.data_segment.base);
@@ -206,53 +816,56 @@ static void init_paging_tables()
                                          :top_data_phys_address / (PAGE_SIZE * 1024);
         u32int page_tables_base_virt_addr       = table_index * PAGE_SIZE * 1024;
         page_tables_rel_virt_addr = page_tables_base_virt_addr - segments_info.data_segment.base;
-        page_table_t *page_tables_table   = alloc_data_page();
-        memset(page_tables_table, 0x0, sizeof(page_table_t));
+        kmap_rel_virt_addr        = page_tables_rel_virt_addr + LARGE_PAGE_SIZE;
         paging_entry_t *pd_entry         = &kernel_page_directory->page_tables[table_index];
-        set_pt_entry(pd_entry, TRUE, TRUE, FALSE, (u32int)page_tables_table + segments_info.data_segment.base);
-        kernel_page_directory->page_table_ptrs[table_index] = (page_table_t*)(page_tables_rel_virt_addr + table_index * PAGE_SIZE);
-        paging_entry_t *pt_entry         = &page_tables_table->pages[table_index];
-        set_pt_entry(pt_entry, TRUE, TRUE, FALSE, (u32int)page_tables_table + segments_info.data_segment.base);//teeest!!!
+        set_pt_entry(pd_entry, TRUE, TRUE, FALSE, cache_write_back, (u32int)kernel_page_directory + segments_info.data_segment.base);
+        //shared zero page
+        zero_page_rel_addr = (u32int)alloc_data_page();
+        ASSERT(zero_page_rel_addr != NULL);
+        page_info(zero_page_rel_addr + segments_info.data_segment.base)->flags |= PAGE_ZERO | PAGE_PINNED;
+        memset((void*)zero_page_rel_addr, 0x0, PAGE_SIZE);
 }
 
 static void map_kernel_pages()
 {
         //map data
         u32int top_data_rel_address    = (u32int)kernel_page_directory + sizeof(page_directory_t);
-        u32int index;
-        for (index = 0; index < top_data_rel_address; index += PAGE_SIZE) {
-                mmap(segments_info.data_segment, index, index, TRUE, FALSE);
-        }
+        mmap_range(segments_info.data_segment, 0x0, 0x0, top_data_rel_address / PAGE_SIZE, TRUE, FALSE, cache_write_back);
         //map stack
         u32int stack_rel_addr = segments_info.data_segment.len - PAGE_SIZE;
-        mmap(segments_info.data_segment, stack_rel_addr, stack_rel_addr, TRUE, FALSE);
+        mmap(segments_info.data_segment, stack_rel_addr, stack_rel_addr, TRUE, FALSE, cache_write_back);
         //map code
         u32int top_code_rel_address    = (u32int)&kernel_code_size;
-        for (index = 0; index < top_code_rel_address; index += PAGE_SIZE) {
-                mmap(segments_info.code_segment, index, index, FALSE, FALSE);
-        }
-        //map video
-        mmap(segments_info.video_segment, 0x0, 0x0, TRUE, FALSE);
+        mmap_range(segments_info.code_segment, 0x0, 0x0, top_code_rel_address / PAGE_SIZE, FALSE, FALSE, cache_write_back);
+        //map video (mmio - uncached)
+        mmap(segments_info.video_segment, 0x0, 0x0, TRUE, FALSE, cache_uncached);
         //map module (if exists)
         if (segments_info.module_segment.len > 0) {
-            u32int top_module_rel_address = segments_info.module_segment.len;
-            for (index = 0; index < top_module_rel_address; index += PAGE_SIZE) {
-                mmap(segments_info.module_segment, index, index, TRUE, FALSE);
-            }
+            mmap_range(segments_info.module_segment, 0x0, 0x0, segments_info.module_segment.len / PAGE_SIZE, TRUE, FALSE, cache_write_back);
         }
 }
 
 void init_paging()
 {
+        //page attribute table for write-combining mappings, 4 MiB pages, global pages
+        init_pat();
+        init_pse();
+        init_pge();
         //alloc page directory and table of page tables
         init_paging_tables();
         //map pages
         map_kernel_pages();
         //init isr handler
         register_interrupt_handler(PAGE_FAULT, page_fault_handler);
+        //kmap slot table is made while frames are still reachable directly, it stays: the slot is never empty
+        get_pt_entry(kmap_rel_virt_addr + segments_info.data_segment.base, kernel_page_directory, TRUE);
         //enable paging
         switch_page_directory(kernel_page_directory);
         ASSERT(is_paging_enabled() == TRUE);
+        kmap_entry = get_pt_entry(kmap_rel_virt_addr + segments_info.data_segment.base, kernel_page_directory, FALSE);
+        kunmap();
+        //kmap slot is not counted by map_pt_entry, this reference keeps its table
+        page_ref(kernel_page_directory->page_tables[(kmap_rel_virt_addr + segments_info.data_segment.base) / LARGE_PAGE_SIZE].address * PAGE_SIZE);
 }
 
 
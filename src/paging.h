@@ -4,6 +4,13 @@
 #include "common.h"
 #include "memory_manager.h"
 
+#define LARGE_PAGE_SIZE (PAGE_SIZE * 1024)
+//pages zeroed ahead of time by the idle loop
+#define ZERO_POOL_SIZE  64
+//cleared page table frames kept for reuse, refilled PT_CACHE_REFILL at a time
+#define PT_CACHE_SIZE   32
+#define PT_CACHE_REFILL 8
+
 typedef struct paging_entry_struct {
         unsigned present        : 1;
         unsigned rw             : 1;
@@ -14,23 +21,67 @@ typedef struct paging_entry_struct {
         unsigned dirty          : 1;
         unsigned size           : 1;
         unsigned global         : 1;
-        unsigned unused         : 3;
+        unsigned cow            : 1;
+        unsigned unused         : 2;
         unsigned address        : 20;
 } paging_entry_t;
 
+typedef enum cache_policy_enum {
+        cache_write_back      = 0x0,
+        cache_write_through   = 0x1,
+        cache_uncached        = 0x2,
+        cache_write_combining = 0x3
+} cache_policy_t;
+
 typedef struct page_table_struct {
         paging_entry_t pages[1024];
 } page_table_t;
 
 typedef struct page_directory_struct {
         paging_entry_t page_tables[1024];
-        page_table_t  *page_table_ptrs[1024];
 } page_directory_t;
 
+typedef struct fault_around_struct {
+        u32int base_pages;
+        u32int window;
+        u32int first_page;
+        u32int next_page;
+        u32int faults;
+        u32int pages_mapped;
+        u32int cow_faults;
+} fault_around_t;
+
+typedef struct zero_pool_struct {
+        u32int pages[ZERO_POOL_SIZE];
+        u32int count;
+        u32int hits;
+        u32int misses;
+} zero_pool_t;
+
+typedef struct pt_cache_struct {
+        u32int frames[PT_CACHE_SIZE];
+        u32int count;
+        u32int allocated;
+        u32int reused;
+        u32int freed;
+} pt_cache_t;
+
 void init_paging();
-bool mmap(segment_t segment, u32int virt_rel_address, u32int phys_rel_address, bool rw, bool user);
+bool mmap(segment_t segment, u32int virt_rel_address, u32int phys_rel_address, bool rw, bool user, cache_policy_t cache);
+bool mmap_range(segment_t segment, u32int virt_rel_address, u32int phys_rel_address, u32int pages_count, bool rw, bool user, cache_policy_t cache);
+bool mmap_alloc_range(segment_t segment, void* (*alloc)(u32int order), u32int virt_rel_address, u32int pages_count, bool rw, bool user, u8int page_flags);
+bool mmap_zero_range(u32int virt_rel_address, u32int pages_count, bool user);
+void mremap_range(u32int old_virt_rel_address, u32int new_virt_rel_address, u32int pages_count);
 bool munmap(segment_t segment, u32int virt_rel_address);
+bool munmap_range(segment_t segment, u32int virt_rel_address, u32int pages_count);
+void tlb_begin_batch();
+void tlb_end_batch();
+void set_write_protect(bool enabled);
+void* alloc_zeroed_data_page();
+bool refill_zero_pool();
 bool is_paging_enabled();
 void print_page_info();
+void set_fault_around_pages(u32int pages_count);
+void print_fault_info();
 
 #endif //PAGING_H
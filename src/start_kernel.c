@@ -6,15 +6,27 @@
 #include "screen.h"
 #include "keyboard.h"
 #include "syscall.h"
+#include "vmalloc.h"
+#include "module.h"
+#include "cpu.h"
+#include "checksum.h"
 
 void start_kernel(u32int code_base_addr,   u32int code_segment_len,
                   u32int data_base_addr,   u32int data_segment_len,
-                  u32int module_base_addr, u32int module_segment_len)
+                  u32int module_base_addr, u32int module_segment_len,
+                  u32int memory_map_addr,  u32int memory_map_count)
 {
-        init_memory_manager(code_base_addr, code_segment_len, data_base_addr, data_segment_len, module_base_addr, module_segment_len);
+        init_cpu();
+        init_string_ops();
+        init_checksum();
+        init_memory_manager(code_base_addr, code_segment_len, data_base_addr, data_segment_len, module_base_addr, module_segment_len,
+                            memory_map_addr, memory_map_count);
         init_descriptor_tables();
         init_paging();
+        release_memory_regions();
         init_heap();
+        init_vmalloc();
+        init_modules();
         init_screen(black, green);
         init_keyboard();
         initialize_syscalls();
@@ -0,0 +1,350 @@
+#include "vmalloc.h"
+#include "paging.h"
+#include "panic.h"
+#include "mutex.h"
+#include "screen.h"
+#include "module_loader.h"
+
+extern segments_info_t   segments_info;
+extern u32int            heap_start_rel_virt_addr;
+extern u32int            heap_size;
+vm_region_t              vm_regions[VM_REGIONS_COUNT];
+vm_region_t             *vm_free_regions;
+vm_region_t             *vm_used_regions;
+vm_region_t             *vm_spare_regions;
+u32int                   vm_used_pages;
+DEFINE_MUTEX(vm_lock);
+
+static vm_region_t* get_region(u32int start, u32int pages_count)
+{
+        vm_region_t *region = vm_spare_regions;
+        ASSERT(region != NULL);
+        vm_spare_regions    = region->next;
+        region->start       = start;
+        region->pages_count = pages_count;
+        region->next        = NULL;
+
+        return region;
+}
+
+static void put_region(vm_region_t *region)
+{
+        region->next     = vm_spare_regions;
+        vm_spare_regions = region;
+}
+
+//sorted insert, merges with both neighbours
+static void insert_free_region(u32int start, u32int pages_count)
+{
+        vm_region_t *prev = NULL, *next = vm_free_regions;
+        while (next != NULL && next->start < start) {
+                prev = next;
+                next = next->next;
+        }
+        if (prev != NULL && prev->start + prev->pages_count * PAGE_SIZE == start) {
+                prev->pages_count += pages_count;
+                if (next != NULL && prev->start + prev->pages_count * PAGE_SIZE == next->start) {
+                        prev->pages_count += next->pages_count;
+                        prev->next         = next->next;
+                        put_region(next);
+                }
+                return;
+        }
+        if (next != NULL && start + pages_count * PAGE_SIZE == next->start) {
+                next->start        = start;
+                next->pages_count += pages_count;
+                return;
+        }
+        vm_region_t *region = get_region(start, pages_count);
+        region->next = next;
+        if (prev != NULL)
+                prev->next = region;
+        else
+                vm_free_regions = region;
+}
+
+//carve fixed window out of the free list, parts that are already taken are skipped
+bool vm_reserve(u32int rel_address, u32int pages_count)
+{
+        u32int end = rel_address + pages_count * PAGE_SIZE;
+        bool   result = FALSE;
+        vm_region_t *prev = NULL, *region;
+        mutex_lock(&vm_lock);
+        region = vm_free_regions;
+        while (region != NULL && region->start < end) {
+                u32int region_end = region->start + region->pages_count * PAGE_SIZE;
+                vm_region_t *next = region->next;
+                if (region_end > rel_address) {
+                        result = TRUE;
+                        if (region->start < rel_address && region_end > end) {
+                                //split in two
+                                vm_region_t *tail = get_region(end, (region_end - end) / PAGE_SIZE);
+                                tail->next          = next;
+                                region->next        = tail;
+                                region->pages_count = (rel_address - region->start) / PAGE_SIZE;
+                                break;
+                        } else if (region->start < rel_address) {
+                                region->pages_count = (rel_address - region->start) / PAGE_SIZE;
+                        } else if (region_end > end) {
+                                region->pages_count = (region_end - end) / PAGE_SIZE;
+                                region->start       = end;
+                        } else {
+                                if (prev != NULL)
+                                        prev->next = next;
+                                else
+                                        vm_free_regions = next;
+                                put_region(region);
+                                region = next;
+                                continue;
+                        }
+                }
+                prev   = region;
+                region = next;
+        }
+        mutex_unlock(&vm_lock);
+
+        return result;
+}
+
+void init_vmalloc()
+{
+        u32int index;
+        vm_spare_regions = NULL;
+        for (index = 0; index < VM_REGIONS_COUNT; index++) {
+                put_region(&vm_regions[index]);
+        }
+        vm_free_regions = NULL;
+        vm_used_regions = NULL;
+        vm_used_pages   = 0;
+        //page 0 stays unmapped: NULL dereference faults
+        insert_free_region(PAGE_SIZE, segments_info.data_segment.len / PAGE_SIZE - 1);
+        //kernel image, page directory, page tables window, kmap slot
+        vm_reserve(0x0, heap_start_rel_virt_addr / PAGE_SIZE);
+        vm_reserve(heap_start_rel_virt_addr, heap_size / PAGE_SIZE);
+        vm_reserve(MODULE_DATA_LOAD_ADDR, segments_info.module_segment.len / PAGE_SIZE + 1);
+        //kernel and module stacks
+        vm_reserve(segments_info.data_segment.len - PAGE_SIZE * 2, 2);
+}
+
+//first fit, the region is put on the used list, vm_lock is held
+static vm_region_t* take_free_region(u32int pages_count)
+{
+        vm_region_t *prev = NULL, *region;
+        for (region = vm_free_regions; region != NULL && region->pages_count < pages_count; region = region->next)
+                prev = region;
+        if (region == NULL || (region->pages_count != pages_count && vm_spare_regions == NULL))
+                return NULL;
+        if (region->pages_count == pages_count) {
+                if (prev != NULL)
+                        prev->next = region->next;
+                else
+                        vm_free_regions = region->next;
+        } else {
+                u32int address       = region->start;
+                region->start       += pages_count * PAGE_SIZE;
+                region->pages_count -= pages_count;
+                region = get_region(address, pages_count);
+        }
+        region->next    = vm_used_regions;
+        vm_used_regions = region;
+
+        return region;
+}
+
+static vm_region_t* find_used_region(void *address, vm_region_t **prev)
+{
+        vm_region_t *region;
+        *prev = NULL;
+        for (region = vm_used_regions; region != NULL && region->start != (u32int)address; region = region->next)
+                *prev = region;
+
+        return region;
+}
+
+//one unmapped guard page after every region, frames come on first write
+void* vmalloc(u32int pages_count)
+{
+        if (pages_count == 0)
+                return NULL;
+        mutex_lock(&vm_lock);
+        vm_region_t *region = take_free_region(pages_count + 1);
+        if (region == NULL) {
+                mutex_unlock(&vm_lock);
+                return NULL;
+        }
+        u32int address = region->start;
+        vm_used_pages += pages_count;
+        mutex_unlock(&vm_lock);
+
+        bool mapped = mmap_zero_range(address, pages_count, FALSE);
+        ASSERT(mapped);
+
+        return (void*)address;
+}
+
+void vfree(void *address)
+{
+        vm_region_t *prev, *region;
+        if (address == NULL)
+                return;
+        mutex_lock(&vm_lock);
+        region = find_used_region(address, &prev);
+        ASSERT(region != NULL);
+        if (prev != NULL)
+                prev->next = region->next;
+        else
+                vm_used_regions = region->next;
+        u32int start = region->start, pages_count = region->pages_count;
+        vm_used_pages -= pages_count - 1;
+        put_region(region);
+        mutex_unlock(&vm_lock);
+
+        munmap_range(segments_info.data_segment, start, pages_count - 1);
+        mutex_lock(&vm_lock);
+        insert_free_region(start, pages_count);
+        mutex_unlock(&vm_lock);
+}
+
+//usable pages of a vmalloc region, 0 for other addresses
+u32int vmalloc_size(void *address)
+{
+        vm_region_t *prev, *region;
+        mutex_lock(&vm_lock);
+        region = find_used_region(address, &prev);
+        u32int pages_count = (region != NULL) ? region->pages_count - 1 : 0;
+        mutex_unlock(&vm_lock);
+
+        return pages_count;
+}
+
+static void clamp_fault_range(u32int rel_address, u32int start, u32int end, u32int *range_start, u32int *range_end)
+{
+        if (end <= rel_address && end > *range_start)
+                *range_start = end;
+        if (start > rel_address && start < *range_end)
+                *range_end = start;
+}
+
+//window a fault at rel_address may map: the heap, a used region without its guard page
+//or the reserved space between regions. FALSE for guard pages and free ranges.
+//the lists are read without vm_lock, the faulting code may be holding it
+bool vm_fault_range(u32int rel_address, u32int *start, u32int *end)
+{
+        vm_region_t *region;
+        if (rel_address >= heap_start_rel_virt_addr && rel_address < heap_start_rel_virt_addr + heap_size) {
+                *start = heap_start_rel_virt_addr;
+                *end   = heap_start_rel_virt_addr + heap_size;
+                return TRUE;
+        }
+        *start = 0;
+        *end   = segments_info.data_segment.len;
+        for (region = vm_used_regions; region != NULL; region = region->next) {
+                u32int region_end = region->start + region->pages_count * PAGE_SIZE;
+                if (rel_address >= region->start && rel_address < region_end) {
+                        *start = region->start;
+                        *end   = region_end - PAGE_SIZE;
+                        return rel_address < *end;
+                }
+                clamp_fault_range(rel_address, region->start, region_end, start, end);
+        }
+        for (region = vm_free_regions; region != NULL && region->start <= rel_address; region = region->next) {
+                u32int region_end = region->start + region->pages_count * PAGE_SIZE;
+                if (rel_address < region_end)
+                        return FALSE;
+                clamp_fault_range(rel_address, region->start, region_end, start, end);
+        }
+        if (region != NULL)
+                clamp_fault_range(rel_address, region->start, region->start + region->pages_count * PAGE_SIZE, start, end);
+
+        return TRUE;
+}
+
+//shrinks in place, grows into the free range behind the guard page or moves the page table entries
+void* vrealloc(void *address, u32int pages_count)
+{
+        vm_region_t *prev, *region, *next;
+        if (address == NULL)
+                return vmalloc(pages_count);
+        if (pages_count == 0) {
+                vfree(address);
+                return NULL;
+        }
+        mutex_lock(&vm_lock);
+        region = find_used_region(address, &prev);
+        ASSERT(region != NULL);
+        u32int start = region->start, old_pages_count = region->pages_count - 1;
+        u32int end   = start + region->pages_count * PAGE_SIZE;
+        //without a spare node for the tail the region keeps its size
+        if (pages_count <= old_pages_count) {
+                if (pages_count == old_pages_count || vm_spare_regions == NULL) {
+                        mutex_unlock(&vm_lock);
+                        return address;
+                }
+                region->pages_count = pages_count + 1;
+                vm_used_pages      -= old_pages_count - pages_count;
+                mutex_unlock(&vm_lock);
+                munmap_range(segments_info.data_segment, start + pages_count * PAGE_SIZE, old_pages_count - pages_count);
+                mutex_lock(&vm_lock);
+                insert_free_region(start + (pages_count + 1) * PAGE_SIZE, old_pages_count - pages_count);
+                mutex_unlock(&vm_lock);
+                return address;
+        }
+
+        u32int extra = pages_count - old_pages_count;
+        vm_region_t *prev_free = NULL;
+        for (next = vm_free_regions; next != NULL && next->start < end; next = next->next)
+                prev_free = next;
+        if (next != NULL && next->start == end && next->pages_count >= extra) {
+                if (next->pages_count == extra) {
+                        if (prev_free != NULL)
+                                prev_free->next = next->next;
+                        else
+                                vm_free_regions = next->next;
+                        put_region(next);
+                } else {
+                        next->start       += extra * PAGE_SIZE;
+                        next->pages_count -= extra;
+                }
+                region->pages_count += extra;
+                vm_used_pages       += extra;
+                mutex_unlock(&vm_lock);
+                bool mapped = mmap_zero_range(start + old_pages_count * PAGE_SIZE, extra, FALSE);
+                ASSERT(mapped);
+                return address;
+        }
+
+        vm_region_t *moved = take_free_region(pages_count + 1);
+        if (moved == NULL) {
+                mutex_unlock(&vm_lock);
+                return NULL;
+        }
+        u32int new_start = moved->start;
+        region = find_used_region(address, &prev);
+        if (prev != NULL)
+                prev->next = region->next;
+        else
+                vm_used_regions = region->next;
+        put_region(region);
+        vm_used_pages += extra;
+        mutex_unlock(&vm_lock);
+
+        mremap_range(start, new_start, old_pages_count);
+        bool mapped = mmap_zero_range(new_start + old_pages_count * PAGE_SIZE, extra, FALSE);
+        ASSERT(mapped);
+        mutex_lock(&vm_lock);
+        insert_free_region(start, old_pages_count + 1);
+        mutex_unlock(&vm_lock);
+
+        return (void*)new_start;
+}
+
+void print_vmalloc_info()
+{
+        u32int free_pages = 0, regions = 0;
+        vm_region_t *region;
+        for (region = vm_free_regions; region != NULL; region = region->next) {
+                free_pages += region->pages_count;
+                regions++;
+        }
+        printf("vmalloc: used: %u pages, free: %u pages in %u ranges", vm_used_pages, free_pages, regions);
+}
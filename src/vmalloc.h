@@ -0,0 +1,24 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "common.h"
+
+#define VM_REGIONS_COUNT 512
+
+//free list is sorted by address, used list keeps sizes for vfree
+typedef struct vm_region_struct {
+        u32int                   start;
+        u32int                   pages_count;
+        struct vm_region_struct *next;
+} vm_region_t;
+
+void  init_vmalloc();
+bool  vm_reserve(u32int rel_address, u32int pages_count);
+void* vmalloc(u32int pages_count);
+void  vfree(void *address);
+void* vrealloc(void *address, u32int pages_count);
+u32int vmalloc_size(void *address);
+bool  vm_fault_range(u32int rel_address, u32int *start, u32int *end);
+void  print_vmalloc_info();
+
+#endif //VMALLOC_H